@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <cstdint>
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
+#include <optional>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <fmt/core.h>
+
+#include "retrogfx.hpp"
+#include "cmdline.hpp"
+#include "util.hpp"
+
+// counts how often each tile appears across many files. tiles are decoded
+// first and counted by the canonical hash of their pixels, so a tile is the
+// same tile whatever format or bpp it was stored in, and so are its flipped
+// versions. only hashes are kept in memory, never the tiles themselves.
+
+struct Entry {
+    uint64_t count = 0;     // times the tile appears in total
+    uint32_t files = 0;     // number of files it appears in
+    uint32_t first = 0;     // first file it was found in (by file number)
+};
+
+// a hash map split in shards, each with its own lock, so that threads
+// merging their counts rarely wait on each other
+class ShardedMap {
+    static constexpr int SHARD_BITS = 6;
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<uint64_t, Entry> map;
+    };
+
+    std::array<Shard, 1 << SHARD_BITS> shards;
+
+    // the low bits already pick the bucket inside a shard
+    Shard &shard_of(uint64_t hash) { return shards[hash >> (64 - SHARD_BITS)]; }
+
+public:
+    // merges the counts of a single file. @counts are sorted by hash, so
+    // that each shard is locked only once
+    void merge(std::span<const std::pair<uint64_t, uint32_t>> counts, uint32_t file)
+    {
+        for (std::size_t i = 0; i < counts.size(); ) {
+            auto &shard = shard_of(counts[i].first);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            for ( ; i < counts.size() && &shard_of(counts[i].first) == &shard; i++) {
+                auto [it, inserted] = shard.map.try_emplace(counts[i].first, Entry{ .first = file });
+                it->second.count += counts[i].second;
+                it->second.files++;
+                it->second.first = std::min(it->second.first, file);
+            }
+        }
+    }
+
+    // only to be used once every thread is done
+    const Entry &get(uint64_t hash) { return shard_of(hash).map.at(hash); }
+
+    std::size_t size() const
+    {
+        std::size_t n = 0;
+        for (auto &s : shards)
+            n += s.map.size();
+        return n;
+    }
+
+    void for_each(auto &&f) const
+    {
+        for (auto &s : shards)
+            for (auto &[hash, entry] : s.map)
+                f(hash, entry);
+    }
+};
+
+struct FileStats {
+    bool ok = false;
+    uint64_t tiles = 0;
+    std::vector<uint64_t> distinct;    // sorted hashes of the file's tiles
+};
+
+// hashes every tile of a file. files are read a chunk at a time, except for
+// containers, which carry their own bpp and format
+std::optional<std::vector<std::pair<uint64_t, uint32_t>>>
+hash_file(std::string_view name, int bpp, retrogfx::Format format, uint64_t &num_tiles)
+{
+    FILE *f = fopen(std::string(name).c_str(), "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", name);
+        std::perror("");
+        return std::nullopt;
+    }
+
+    std::unordered_map<uint64_t, uint32_t> counts;
+    std::array<uint8_t, retrogfx::TILE_WIDTH * retrogfx::TILE_HEIGHT> pixels;
+    auto add = [&](std::span<const uint8_t> tiles, int bpp, retrogfx::Format format) {
+        std::size_t bpt = bpp*8;
+        for (std::size_t i = 0; i + bpt <= tiles.size(); i += bpt) {
+            retrogfx::decode_tile(tiles.subspan(i, bpt), bpp, format, pixels.data());
+            counts[retrogfx::hash_tile_canonical(pixels, 8, retrogfx::Format::GBA)]++;
+            num_tiles++;
+        }
+    };
+
+    if (name.ends_with(".rgfx")) {
+        auto file = read_all(f);
+        fclose(f);
+        auto container = retrogfx::read_container(file);
+        auto tiles = container ? container->tiles() : std::vector<uint8_t>{};
+        if (!container || (tiles.empty() && container->size() != 0)) {
+            fmt::print(stderr, "error: {} isn't a valid retrogfx container\n", name);
+            return std::nullopt;
+        }
+        add(tiles, container->bpp(), container->format());
+    } else {
+        // a whole number of tiles per chunk; a trailing partial tile is
+        // ignored, as decode() would do
+        std::vector<uint8_t> buf(bpp*8 * 4096);
+        while (auto n = std::fread(buf.data(), 1, buf.size(), f))
+            add(std::span(buf).first(n - n % (bpp*8)), bpp, format);
+        fclose(f);
+    }
+
+    std::vector<std::pair<uint64_t, uint32_t>> res(counts.begin(), counts.end());
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+using cmdline::ParamType;
+
+static const cmdline::Argument arglist[] = {
+    { 'h', "help",    "show this help text"                                         },
+    { 'b', "bpp",     "NUMBER: specify bpp (bits per pixel)",     ParamType::Single },
+    { 'f', "format",  "(planar | interwined | gba | ps1 | n64 | vb | ngp): specify format", ParamType::Single },
+    { 'n', "top",     "NUMBER: show the NUMBER most common tiles (default 20)", ParamType::Single },
+    { 'j', "threads", "NUMBER: use NUMBER threads",               ParamType::Single },
+};
+
+int main(int argc, char *argv[])
+{
+    auto result = cmdline::parse(argc, argv, arglist);
+    if (argc < 2 || result.has('h') || result.items.empty()) {
+        fmt::print(stderr, "usage: census [file...] (.rgfx containers use their own bpp and format)\n");
+        cmdline::print_args(arglist);
+        return result.has('h') ? 0 : 1;
+    }
+
+    int bpp = 2;
+    if (result.has('b')) {
+        auto num = to_number(result.params['b']);
+        if (!num || num.value() < 1 || num.value() > 8)
+            fmt::print(stderr, "warning: bpp can only be 1 to 8 (default of 2 will be used)\n");
+        else
+            bpp = num.value();
+    }
+    auto format = retrogfx::Format::Planar;
+    if (result.has('f')) {
+        if (auto r = retrogfx::string_to_format(result.params['f']); r)
+            format = r.value();
+        else
+            fmt::print(stderr, "warning: invalid argument {} for -f (default \"planar\" will be used)\n", result.params['f']);
+    }
+    if (!retrogfx::format_supports_bpp(format, bpp)) {
+        fmt::print(stderr, "error: format {} can't use {} bpp\n", retrogfx::format_to_string(format).value(), bpp);
+        return 1;
+    }
+    int top = 20;
+    if (result.has('n')) {
+        auto num = to_number(result.params['n']);
+        if (!num || num.value() < 0)
+            fmt::print(stderr, "warning: invalid value {} for -n (default of 20 will be used)\n", result.params['n']);
+        else
+            top = num.value();
+    }
+    std::size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (result.has('j')) {
+        auto num = to_number(result.params['j']);
+        if (!num || num.value() < 1)
+            fmt::print(stderr, "warning: invalid value {} for -j\n", result.params['j']);
+        else
+            num_threads = num.value();
+    }
+
+    // a pool of workers, each taking the next file that nobody took yet
+    auto &files = result.items;
+    std::vector<FileStats> stats(files.size());
+    ShardedMap map;
+    std::atomic<std::size_t> next = 0;
+    auto work = [&] {
+        for (std::size_t i; (i = next++) < files.size(); ) {
+            auto counts = hash_file(files[i], bpp, format, stats[i].tiles);
+            if (!counts)
+                continue;
+            map.merge(*counts, i);
+            stats[i].ok = true;
+            for (auto &[hash, count] : *counts)
+                stats[i].distinct.push_back(hash);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < std::min(num_threads, files.size()); t++)
+        threads.emplace_back(work);
+    for (auto &t : threads)
+        t.join();
+
+    uint64_t total = 0;
+    for (auto &s : stats)
+        total += s.tiles;
+    fmt::print("{} files, {} tiles, {} distinct tiles\n", files.size(), total, map.size());
+
+    std::vector<std::pair<uint64_t, Entry>> entries;
+    entries.reserve(map.size());
+    map.for_each([&](uint64_t hash, const Entry &e) { entries.emplace_back(hash, e); });
+    auto n = std::min<std::size_t>(top, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), [](const auto &a, const auto &b) {
+        return a.second.count != b.second.count ? a.second.count > b.second.count : a.first < b.first;
+    });
+    fmt::print("\nmost common tiles:\n{:>16}  {:>10}  {:>6}  {}\n", "hash", "count", "files", "first seen in");
+    for (std::size_t i = 0; i < n; i++) {
+        auto &[hash, e] = entries[i];
+        fmt::print("{:016x}  {:>10}  {:>6}  {}\n", hash, e.count, e.files, files[e.first]);
+    }
+
+    // a tile is unique to a file when no other file has it
+    fmt::print("\nper file:\n{:>10}  {:>10}  {:>10}  {:>7}  {}\n", "tiles", "distinct", "unique", "unique%", "file");
+    for (std::size_t i = 0; i < files.size(); i++) {
+        if (!stats[i].ok)
+            continue;
+        auto unique = std::count_if(stats[i].distinct.begin(), stats[i].distinct.end(), [&](uint64_t h) {
+            return map.get(h).files == 1;
+        });
+        auto distinct = stats[i].distinct.size();
+        fmt::print("{:>10}  {:>10}  {:>10}  {:>6.1f}%  {}\n", stats[i].tiles, distinct, unique,
+                   distinct == 0 ? 0.0 : 100.0 * unique / distinct, files[i]);
+    }
+    return 0;
+}
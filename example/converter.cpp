@@ -9,6 +9,14 @@
 #include <string_view>
 #include <memory>
 #include <algorithm>
+#include <functional>
+#include <variant>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 #include <fmt/core.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -19,16 +27,12 @@
 
 #include "retrogfx.hpp"
 #include "cmdline.hpp"
-
-template <typename TStr = std::string>
-std::optional<int> to_number(const TStr &str, unsigned base = 10)
-{
-    int value = 0;
-    auto res = std::from_chars(str.data(), str.data() + str.size(), value, base);
-    if (res.ec != std::errc() || res.ptr != str.data() + str.size())
-        return std::nullopt;
-    return value;
-}
+#include "util.hpp"
+#include "png.hpp"
+#include "qoi.hpp"
+#include "zip.hpp"
+#include "romset.hpp"
+#include "watch.hpp"
 
 auto make_gray_pal(int bpp, int channels)
 {
@@ -45,79 +49,869 @@ auto make_gray_pal(int bpp, int channels)
     return pal;
 }
 
-int encode_image(std::string_view input, std::string_view output, int bpp, retrogfx::Format format)
+// "-" stands for stdin or stdout, so that the converter can be used in pipes
+FILE *open_file(std::string_view name, const char *mode)
 {
-    int width, height, channels;
-    unsigned char *img_data = stbi_load(input.data(), &width, &height, &channels, 0);
+    if (name == "-")
+        return mode[0] == 'r' ? stdin : stdout;
+    return fopen(name.data(), mode);
+}
+
+void close_file(FILE *f)
+{
+    if (f != stdin && f != stdout)
+        fclose(f);
+}
+
+// images are PNGs, or QOI images when their name ends in .qoi. either way
+// they're read and written one row at a time
+class ImageReader {
+    std::variant<png::Reader, qoi::Reader> reader;
+
+public:
+    ImageReader(std::string_view name, FILE *f)
+        : reader(name.ends_with(".qoi") ? decltype(reader)(std::in_place_type<qoi::Reader>, f)
+                                        : decltype(reader)(std::in_place_type<png::Reader>, f))
+    { }
+
+    bool ok() const                                { return std::visit([](auto &r) { return r.ok(); }, reader); }
+    std::span<const uint8_t> consumed() const      { return std::visit([](auto &r) { return r.consumed(); }, reader); }
+    std::size_t width() const                      { return std::visit([](auto &r) { return r.width(); }, reader); }
+    std::size_t height() const                     { return std::visit([](auto &r) { return r.height(); }, reader); }
+    int channels() const                           { return std::visit([](auto &r) { return r.channels(); }, reader); }
+    bool read_row(std::span<uint8_t> row)          { return std::visit([&](auto &r) { return r.read_row(row); }, reader); }
+};
+
+class ImageWriter {
+    std::variant<std::monostate, png::Writer, qoi::Writer> writer;
+
+public:
+    ImageWriter(std::string_view name, FILE *f, std::size_t width, std::size_t height, int channels)
+    {
+        if (name.ends_with(".qoi"))
+            writer.emplace<qoi::Writer>(f, width, height, channels);
+        else
+            writer.emplace<png::Writer>(f, width, height, channels);
+    }
+
+    void write_row(std::span<const uint8_t> row)
+    {
+        std::visit([&](auto &w) { if constexpr (!std::is_same_v<decltype(w), std::monostate &>) w.write_row(row); }, writer);
+    }
+
+    void finish()
+    {
+        std::visit([](auto &w) { if constexpr (!std::is_same_v<decltype(w), std::monostate &>) w.finish(); }, writer);
+    }
+};
+
+bool write_file(std::string_view output, std::span<const uint8_t> data)
+{
+    FILE *f = fopen(output.data(), "w");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return false;
+    }
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    return true;
+}
+
+// writes the tilemap as 16-bit little endian tile numbers. fails, without
+// writing anything, if a tile number doesn't fit
+bool write_tilemap(std::string_view output, std::span<std::size_t> tilemap)
+{
+    if (auto it = std::find_if(tilemap.begin(), tilemap.end(), [](auto t) { return t > 0xFFFF; });
+        it != tilemap.end()) {
+        fmt::print(stderr, "error: tile {} doesn't fit in a 16-bit entry of {} (reduce to at most 65536 tiles)\n",
+                   *it, output);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    for (auto t : tilemap) {
+        data.push_back(t & 0xFF);
+        data.push_back(t >> 8);
+    }
+    return write_file(output, data);
+}
+
+// loads a whole image with stb_image, for when it can't be read row by row.
+// @prefix are the bytes that were already read from @f
+std::vector<uint8_t> load_image(FILE *f, std::span<const uint8_t> prefix, int &width, int &height, int &channels)
+{
+    auto file = read_all(f, prefix);
+    unsigned char *img_data = stbi_load_from_memory(file.data(), file.size(), &width, &height, &channels, 0);
     if (!img_data) {
+        width = height = channels = 0;
+        return {};
+    }
+    std::vector<uint8_t> res(img_data, img_data + channels*width*height);
+    stbi_image_free(img_data);
+    return res;
+}
+
+// gets the size of the image @input, opened as @f with @reader. PNG and QOI
+// images can then be read one row at a time from @reader, unless @whole is
+// set; anything else, or a @whole image, gets loaded into @pixels. returns
+// false (after printing why) if the image can't be read or isn't made of tiles
+bool open_image(std::string_view input, FILE *f, ImageReader &reader, bool whole,
+                int &width, int &height, int &channels, std::vector<uint8_t> &pixels)
+{
+    width = height = channels = 0;
+    if (reader.ok()) {
+        width    = reader.width();
+        height   = reader.height();
+        channels = reader.channels();
+        if (whole) {
+            std::vector<uint8_t> row(width * channels);
+            for (auto y = 0; y < height && reader.read_row(row); y++)
+                pixels.insert(pixels.end(), row.begin(), row.end());
+        }
+    } else
+        pixels = load_image(f, reader.consumed(), width, height, channels);
+    if ((whole || !reader.ok()) && (pixels.empty() || pixels.size() != std::size_t(channels*width*height))) {
         fmt::print(stderr, "error: couldn't load image {}\n", input);
+        return false;
+    }
+    if (width % 8 != 0 || height % 8 != 0) {
+        fmt::print(stderr, "error: width and height must be multiples of 8\n");
+        return false;
+    }
+    return true;
+}
+
+int encode_image(std::string_view input, std::string_view output, int bpp, retrogfx::Format format,
+                 std::optional<std::size_t> max_tiles, bool quantize)
+{
+    FILE *in = open_file(input, "rb");
+    if (!in) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
         return 1;
     }
 
-    FILE *out = fopen(output.data(), "w");
+    // PNG and QOI images are read one row at a time and each row goes
+    // straight to the encoder, so that only a few rows are in memory at once.
+    // anything else goes through stb_image, as does quantizing, which needs
+    // every color of the image up front
+    ImageReader reader(input, in);
+    bool stream = reader.ok() && !quantize;
+    int width, height, channels;
+    std::vector<uint8_t> pixels;
+    if (!open_image(input, in, reader, quantize, width, height, channels, pixels))
+        return 1;
+    std::vector<uint8_t> row(width * channels);
+
+    FILE *out = open_file(output, "wb");
     if (!out) {
         fmt::print(stderr, "error: couldn't write to {}\n", output);
         std::perror("");
         return 1;
     }
 
-    auto pal = make_gray_pal(bpp, channels);
-    auto tmp = std::span<uint8_t>(img_data, channels*width*height);
-    std::vector<uint8_t> data;
-    auto err = retrogfx::make_indexed(tmp, std::span(pal), channels, [&](std::size_t i) { data.push_back(i); });
-    if (err >= 0) {
-        fmt::print(stderr, "error: color not found at index {}\n", err);
-        return 1;
+    // next_row() fills a row of indexes, returning false on errors
+    std::function<bool(std::span<uint8_t>, int)> next_row;
+    std::vector<uint8_t> data, pal_data;
+    if (quantize) {
+        auto pal = retrogfx::make_palette(pixels, channels, retrogfx::bpp_size(bpp));
+        data.resize(width * height);
+        retrogfx::make_indexed_nearest(pixels, pal, channels, data);
+        for (auto &color : pal)
+            pal_data.insert(pal_data.end(), color.begin(), color.end());
+        if (!write_file(std::string(output) + ".pal", pal_data))
+            return 1;
+        next_row = [&](std::span<uint8_t> indices, int y) {
+            std::copy(&data[y * width], &data[(y+1) * width], indices.begin());
+            return true;
+        };
+    } else {
+        for (auto &color : make_gray_pal(bpp, channels))
+            pal_data.insert(pal_data.end(), color.begin(), color.end());
+        next_row = [&, pal = make_gray_pal(bpp, channels)](std::span<uint8_t> indices, int y) {
+            auto colors = std::span(pixels);
+            if (stream) {
+                if (!reader.read_row(row)) {
+                    fmt::print(stderr, "error: couldn't read image {}\n", input);
+                    return false;
+                }
+                colors = row;
+            } else
+                colors = colors.subspan(y * width * channels, width * channels);
+            auto it = indices.begin();
+            auto err = retrogfx::make_indexed(colors, std::span(pal), channels, [&](std::size_t i) { *it++ = i; });
+            if (err >= 0) {
+                fmt::print(stderr, "error: color not found at index {}\n", y * width * channels + err);
+                return false;
+            }
+            return true;
+        };
     }
 
-    retrogfx::encode(data, width, height, bpp, format, [&](std::span<uint8_t> tile) {
-        fwrite(tile.data(), 1, tile.size(), out);
+    // containers need every tile too, to deduplicate them
+    bool container = output.ends_with(".rgfx");
+    std::vector<uint8_t> tiles, indices(width);
+    retrogfx::Encoder encoder(width, bpp, format, [&](std::span<uint8_t> tile) {
+        if (max_tiles || container)
+            tiles.insert(tiles.end(), tile.begin(), tile.end());
+        else
+            fwrite(tile.data(), 1, tile.size(), out);
     });
+    for (auto y = 0; y < height; y++) {
+        if (!next_row(indices, y))
+            return 1;
+        encoder.push_row(indices);
+    }
+    encoder.finish();
+    close_file(in);
 
-    fclose(out);
-    return 0;
+    if (container) {
+        // a container has its own index, so reduced tiles go back in
+        // tilemap order
+        if (max_tiles) {
+            auto reduced = retrogfx::reduce_tiles(tiles, bpp, format, max_tiles.value());
+            std::size_t bpt = bpp*8;
+            for (std::size_t i = 0; i < reduced.tilemap.size(); i++)
+                std::copy_n(&reduced.tiles[reduced.tilemap[i] * bpt], bpt, &tiles[i * bpt]);
+        }
+        auto file = retrogfx::write_container(tiles, bpp, format, pal_data, channels,
+                                              retrogfx::Compression::Tiles);
+        fwrite(file.data(), 1, file.size(), out);
+        close_file(out);
+        return 0;
+    }
+
+    if (!max_tiles) {
+        close_file(out);
+        return 0;
+    }
+
+    auto reduced = retrogfx::reduce_tiles(tiles, bpp, format, max_tiles.value());
+    fwrite(reduced.tiles.data(), 1, reduced.tiles.size(), out);
+    close_file(out);
+    fmt::print(stderr, "reduced {} tiles to {} (total error: {} pixels, max error: {} pixels)\n",
+               reduced.tilemap.size(), reduced.tiles.size() / (bpp*8),
+               reduced.total_error, reduced.max_error);
+    return write_tilemap(std::string(output) + ".map", reduced.tilemap) ? 0 : 1;
+}
+
+// writes CHR data to output, then the nametable followed by the attribute
+// table to output.nam and the 4 sub-palettes to output.pal
+int encode_nes_background(std::string_view input, std::string_view output)
+{
+    int width, height, channels;
+    FILE *in = open_file(input, "rb");
+    unsigned char *img_data = in ? stbi_load_from_file(in, &width, &height, &channels, 0) : nullptr;
+    if (in)
+        close_file(in);
+    if (!img_data) {
+        fmt::print(stderr, "error: couldn't load image {}\n", input);
+        return 1;
+    }
+    if (width % 16 != 0 || height % 16 != 0) {
+        fmt::print(stderr, "error: width and height must be multiples of 16\n");
+        return 1;
+    }
+
+    auto data = std::span<uint8_t>(img_data, channels*width*height);
+    auto bg = retrogfx::make_nes_background(data, width, height, channels);
+    if (!bg) {
+        fmt::print(stderr, "error: image doesn't fit NES constraints (at most 4 colors "
+                           "per 16x16 area, 4 sub-palettes and 256 tiles)\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> nam = bg->nametable;
+    nam.insert(nam.end(), bg->attributes.begin(), bg->attributes.end());
+    std::vector<uint8_t> pal;
+    for (auto i = 0u; i < 4; i++)
+        for (auto c : i < bg->palettes.size() ? bg->palettes[i] : bg->palettes[0])
+            pal.insert(pal.end(), bg->colors[c].begin(), bg->colors[c].end());
+
+    return write_file(output, bg->chr)
+        && write_file(std::string(output) + ".nam", nam)
+        && write_file(std::string(output) + ".pal", pal) ? 0 : 1;
 }
 
+// returns -1 when the size can't be known, e.g. for pipes
 long filesize(FILE *f)
 {
     long pos = ftell(f);
-    fseek(f, 0, SEEK_END);
+    if (pos < 0 || fseek(f, 0, SEEK_END) != 0)
+        return -1;
     long res = ftell(f);
     fseek(f, pos, SEEK_SET);
     return res;
 }
 
+// how many bytes are pushed to a decoder at once: enough for it to decode
+// them in parallel
+const std::size_t PUSH_SIZE = 1 << 20;
+
+// decodes whatever @feed pushes into the decoder it's given and writes the
+// image to @out. @size is how many bytes will be pushed, or -1 if unknown
+void decode_stream(std::string_view output, FILE *out, long size, int bpp, retrogfx::Format format,
+                   std::function<void(retrogfx::Decoder &)> feed)
+{
+    // the image's header needs its height: if the input's size is known
+    // rows are written out as they're decoded, otherwise they're kept
+    // until the input ends
+    size_t width = retrogfx::ROW_SIZE;
+    std::optional<ImageWriter> writer;
+    if (size >= 0)
+        writer.emplace(output, out, width, retrogfx::img_height(size, bpp), 1);
+    std::vector<uint8_t> rows;
+
+    auto pal = make_gray_pal(bpp, 1);
+    std::array<uint8_t, retrogfx::ROW_SIZE> line;
+    retrogfx::Decoder decoder(bpp, format, [&](std::span<int> row) {
+        for (size_t x = 0; x < width; x++)
+            line[x] = pal[row[x]][0];
+        if (writer)
+            writer->write_row(line);
+        else
+            rows.insert(rows.end(), line.begin(), line.end());
+    });
+
+    feed(decoder);
+    decoder.finish();
+
+    if (!writer) {
+        writer.emplace(output, out, width, rows.size() / width, 1);
+        for (size_t i = 0; i < rows.size(); i += width)
+            writer->write_row(std::span(rows).subspan(i, width));
+    }
+    writer->finish();
+}
+
 int decode_to_image(std::string_view input, std::string_view output, int bpp, retrogfx::Format format)
 {
-    FILE *f = fopen(input.data(), "r");
+    FILE *f = open_file(input, "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
+        return 1;
+    }
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return 1;
+    }
+    decode_stream(output, out, filesize(f), bpp, format, [&](retrogfx::Decoder &decoder) {
+        std::vector<uint8_t> buf(PUSH_SIZE);
+        while (auto n = std::fread(buf.data(), 1, buf.size(), f))
+            decoder.push(std::span(buf).first(n));
+    });
+    close_file(f);
+    close_file(out);
+    return 0;
+}
+
+// decodes tiles packed in a stream of bits, starting at bit @bit_offset and
+// @bit_stride bits apart
+int decode_bits(std::string_view input, std::string_view output, std::size_t bit_offset, std::size_t bit_stride,
+                int bpp, retrogfx::Format format)
+{
+    FILE *f = open_file(input, "rb");
     if (!f) {
         fmt::print(stderr, "error: couldn't open file {}: ", input);
         std::perror("");
         return 1;
     }
-    long size = filesize(f);
-    auto ptr = std::make_unique<uint8_t[]>(size);
-    std::fread(ptr.get(), 1, size, f);
-    auto bytes = std::span{ptr.get(), std::size_t(size)};
+    auto bytes = read_all(f);
+    close_file(f);
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return 1;
+    }
+    // as many tiles as fit whole from @bit_offset on
+    std::size_t tile_bits = bpp*64, total_bits = bytes.size() * 8, num_tiles = 0;
+    if (bit_offset <= total_bits && total_bits - bit_offset >= tile_bits)
+        num_tiles = (total_bits - bit_offset - tile_bits) / bit_stride + 1;
+    decode_stream(output, out, num_tiles * bpp*8, bpp, format, [&](retrogfx::Decoder &decoder) {
+        retrogfx::gather_bits(bytes, bit_offset, bit_stride, bpp, [&](std::span<const uint8_t> tiles) {
+            decoder.push(tiles);
+        });
+    });
+    close_file(out);
+    return 0;
+}
 
-    size_t height = retrogfx::img_height(size, bpp);
-    size_t width  = retrogfx::ROW_SIZE;
-    auto img_data = std::make_unique<uint8_t[]>(retrogfx::ROW_SIZE * height);
+// encodes an image into the tiles of a stream of bits, starting at bit
+// @bit_offset and @bit_stride bits apart. bits between tiles are kept from
+// @output if it exists, otherwise they're 0
+int encode_bits(std::string_view input, std::string_view output, std::size_t bit_offset, std::size_t bit_stride,
+                int bpp, retrogfx::Format format)
+{
+    FILE *in = open_file(input, "rb");
+    if (!in) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
+        return 1;
+    }
+    ImageReader reader(input, in);
+    int width, height, channels;
+    std::vector<uint8_t> pixels;
+    bool ok = open_image(input, in, reader, true, width, height, channels, pixels);
+    close_file(in);
+    if (!ok)
+        return 1;
+    std::vector<uint8_t> indices(width * height);
+    auto it = indices.begin();
+    auto pal = make_gray_pal(bpp, channels);
+    auto err = retrogfx::make_indexed(pixels, std::span(pal), channels, [&](std::size_t i) { *it++ = i; });
+    if (err >= 0) {
+        fmt::print(stderr, "error: color not found at index {}\n", err);
+        return 1;
+    }
 
-    auto pal = make_gray_pal(bpp, 1);
-    int y = 0;
-    retrogfx::decode(bytes, bpp, format, [&](std::span<int> row) {
-        for (int x = 0; x < width; x++)
-            img_data[y * width + x] = pal[row[x]][0];
-        y++;
+    // the output must hold every tile, but may already be longer than that
+    std::vector<uint8_t> bytes;
+    if (output != "-") {
+        if (FILE *f = open_file(output, "rb")) {
+            bytes = read_all(f);
+            close_file(f);
+        }
+    }
+    std::size_t num_tiles = width/8 * height/8;
+    if (num_tiles > 0) {
+        auto bits = bit_offset + (num_tiles - 1) * bit_stride + bpp*64;
+        bytes.resize(std::max(bytes.size(), (bits + 7) / 8));
+        retrogfx::encode_bits(indices, width, height, bpp, format, bytes, bit_offset, bit_stride);
+    }
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return 1;
+    }
+    fwrite(bytes.data(), 1, bytes.size(), out);
+    close_file(out);
+    return 0;
+}
+
+// decodes the ROM set made of @files, gathering bytes from the files as
+// the decoder needs them
+int decode_romset(std::span<const std::string_view> files, romset::Layout layout, std::string_view output,
+                  int bpp, retrogfx::Format format)
+{
+    std::string error;
+    auto source = romset::Source::open(files, layout, error);
+    if (!source) {
+        fmt::print(stderr, "error: {}\n", error);
+        return 1;
+    }
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return 1;
+    }
+    decode_stream(output, out, source->size(), bpp, format, [&](retrogfx::Decoder &decoder) {
+        // files that need no gathering are decoded in place
+        if (auto direct = source->direct()) {
+            for (auto data : *direct)
+                decoder.push(data);
+            return;
+        }
+        std::vector<uint8_t> buf(PUSH_SIZE);
+        for (std::size_t offset = 0, n; (n = source->read(offset, buf)) > 0; offset += n)
+            decoder.push(std::span(buf).first(n));
     });
+    close_file(out);
+    return 0;
+}
+
+// opens a zip archive and reads its directory. @archive must be a file
+// (not stdin), as zip archives need seeking
+FILE *open_zip(std::string_view archive, std::vector<zip::Entry> &entries)
+{
+    FILE *f = fopen(std::string(archive).c_str(), "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", archive);
+        std::perror("");
+        return nullptr;
+    }
+    auto dir = zip::read_directory(f);
+    if (!dir) {
+        fmt::print(stderr, "error: {} isn't a zip archive\n", archive);
+        fclose(f);
+        return nullptr;
+    }
+    entries = std::move(dir.value());
+    return f;
+}
+
+// decodes one member of @f straight from the archive, inflating it a chunk
+// at a time into the decoder
+bool decode_zip_entry(FILE *f, std::string_view archive, const zip::Entry &entry, std::string_view output,
+                      int bpp, retrogfx::Format format)
+{
+    if (entry.encrypted()) {
+        fmt::print(stderr, "error: {} in {}: encrypted entries are not supported\n", entry.name, archive);
+        return false;
+    }
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return false;
+    }
+    bool ok = true;
+    decode_stream(output, out, entry.size, bpp, format, [&](retrogfx::Decoder &decoder) {
+        std::vector<uint8_t> buf;
+        ok = zip::read_entry(f, entry, [&](std::span<const uint8_t> chunk) {
+            buf.insert(buf.end(), chunk.begin(), chunk.end());
+            if (buf.size() >= PUSH_SIZE) {
+                decoder.push(buf);
+                buf.clear();
+            }
+        });
+        decoder.push(buf);
+    });
+    close_file(out);
+    if (!ok) {
+        fmt::print(stderr, "error: couldn't read {} from {} (corrupt, or not stored or deflated)\n",
+                   entry.name, archive);
+        // what was written is an image cut short
+        if (output != "-")
+            std::remove(std::string(output).c_str());
+    }
+    return ok;
+}
+
+// @input is ARCHIVE.zip:MEMBER
+int decode_zip_member(std::string_view input, std::string_view output, int bpp, retrogfx::Format format)
+{
+    auto sep = input.find(".zip:") + 4;
+    auto archive = input.substr(0, sep), member = input.substr(sep + 1);
+    std::vector<zip::Entry> entries;
+    FILE *f = open_zip(archive, entries);
+    if (!f)
+        return 1;
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const auto &e) { return e.name == member; });
+    bool ok = it != entries.end() && decode_zip_entry(f, archive, *it, output, bpp, format);
+    if (it == entries.end())
+        fmt::print(stderr, "error: {} has no member named {}\n", archive, member);
+    fclose(f);
+    return ok ? 0 : 1;
+}
 
-    stbi_write_png(output.data(), width, height, 1, img_data.get(), 0);
+// decodes every member of @archive into the directory @output, one image
+// per member, on as many threads as there are cores. each thread reads the
+// archive through its own FILE, so that they don't fight over the position
+int decode_zip_archive(std::string_view archive, std::string_view output, int bpp, retrogfx::Format format)
+{
+    std::vector<zip::Entry> entries;
+    FILE *f = open_zip(archive, entries);
+    if (!f)
+        return 1;
     fclose(f);
 
+    // the archive's directories are kept, without any "..", so that nothing
+    // is written outside of @output. every member gets its own image, even
+    // if two names end up the same (or an image would take a directory's
+    // name): later ones get a number
+    std::vector<std::filesystem::path> paths;
+    std::set<std::filesystem::path> dirs, files;
+    for (auto &entry : entries) {
+        std::filesystem::path path = output;
+        for (auto &part : std::filesystem::path(entry.name).relative_path())
+            if (part != ".." && part != "." && !part.empty())
+                path /= part;
+        if (path == output)
+            path /= "unnamed";
+        for (auto p = path.parent_path(); p != output && !p.empty(); p = p.parent_path())
+            dirs.insert(p);
+        paths.push_back(path);
+    }
+    for (auto &path : paths) {
+        auto base = path.string();
+        path = base + ".png";
+        for (int n = 2; dirs.count(path) || files.count(path); n++)
+            path = fmt::format("{}~{}.png", base, n);
+        files.insert(path);
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(output, ec);
+    for (auto &dir : dirs)
+        if (!ec)
+            std::filesystem::create_directories(dir, ec);
+    if (ec) {
+        fmt::print(stderr, "error: couldn't create directories in {}: {}\n", output, ec.message());
+        return 1;
+    }
+
+    std::atomic<std::size_t> next = 0, failed = 0;
+    auto work = [&] {
+        FILE *f = fopen(std::string(archive).c_str(), "rb");
+        for (std::size_t i; f && (i = next++) < entries.size(); )
+            failed += !decode_zip_entry(f, archive, entries[i], paths[i].string(), bpp, format);
+        if (f)
+            fclose(f);
+        else
+            failed = entries.size();
+    };
+    std::vector<std::thread> threads;
+    auto num_threads = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1u), entries.size());
+    for (std::size_t t = 0; t < num_threads; t++)
+        threads.emplace_back(work);
+    for (auto &t : threads)
+        t.join();
+    fmt::print(stderr, "decoded {} of {} members into {}\n", entries.size() - failed, entries.size(), output);
+    return failed == 0 ? 0 : 1;
+}
+
+// containers have their own format, bpp and palette, so -b and -f aren't
+// needed. the palette is used for the image's colors when it's complete
+int decode_container(std::string_view input, std::string_view output)
+{
+    FILE *f = open_file(input, "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
+        return 1;
+    }
+    auto file = read_all(f);
+    close_file(f);
+    auto container = retrogfx::read_container(file);
+    auto tiles = container ? container->tiles() : std::vector<uint8_t>{};
+    if (!container || (tiles.empty() && container->size() != 0)) {
+        fmt::print(stderr, "error: {} isn't a valid retrogfx container\n", input);
+        return 1;
+    }
+
+    int bpp = container->bpp();
+    int channels = container->channels();
+    std::vector<std::vector<uint8_t>> pal;
+    auto colors = container->palette();
+    if (channels > 0 && colors.size() / channels >= std::size_t(retrogfx::bpp_size(bpp))) {
+        for (std::size_t i = 0; i < colors.size(); i += channels)
+            pal.emplace_back(colors.begin() + i, colors.begin() + i + channels);
+    } else {
+        channels = 1;
+        pal = make_gray_pal(bpp, 1);
+    }
+
+    FILE *out = open_file(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        return 1;
+    }
+    ImageWriter writer(output, out, retrogfx::ROW_SIZE, retrogfx::img_height(tiles.size(), bpp), channels);
+    std::vector<uint8_t> line(retrogfx::ROW_SIZE * channels);
+    retrogfx::decode(tiles, bpp, container->format(), [&](std::span<int> row) {
+        for (std::size_t x = 0; x < row.size(); x++)
+            std::copy(pal[row[x]].begin(), pal[row[x]].end(), &line[x * channels]);
+        writer.write_row(line);
+    });
+    writer.finish();
+    close_file(out);
     return 0;
 }
 
+// what a conversion wrote, to tell whether anything changed: a hash for
+// each tile, and one for each side file (.pal, .map, and a container's
+// palette and tilemap)
+struct OutputHashes {
+    std::vector<uint64_t> tiles;
+    std::vector<uint64_t> sides;
+};
+
+// an image and where it gets converted to, for --watch
+struct Asset {
+    std::string input, output;
+    int bpp;
+    retrogfx::Format format;
+    OutputHashes hashes;            // of what was last written
+};
+
+struct ConvertOptions {
+    std::optional<std::size_t> max_tiles;
+    bool quantize;
+};
+
+// tiles are hashed decoded, so that containers (whose bytes don't line up
+// with tiles) are compared by their pixels too. missing files hash as empty
+OutputHashes hash_output(std::string_view name, int bpp, retrogfx::Format format)
+{
+    auto load = [](const std::string &name) {
+        std::vector<uint8_t> data;
+        if (FILE *f = fopen(name.c_str(), "rb"); f) {
+            data = read_all(f);
+            fclose(f);
+        }
+        return data;
+    };
+    auto hash_bytes = [](std::span<const uint8_t> data) {
+        return uint64_t(std::hash<std::string_view>{}(std::string_view((const char *) data.data(), data.size())));
+    };
+
+    OutputHashes res;
+    auto data = load(std::string(name));
+    if (name.ends_with(".rgfx")) {
+        auto container = retrogfx::read_container(data);
+        data = container ? container->tiles() : std::vector<uint8_t>{};
+        if (container) {
+            bpp    = container->bpp();
+            format = container->format();
+            res.sides.push_back(hash_bytes(container->palette()));
+            std::vector<uint8_t> index;
+            for (std::size_t i = 0; i < container->size(); i++)
+                for (int b = 0; b < 4; b++)
+                    index.push_back(container->unique_index(i) >> (b*8));
+            res.sides.push_back(hash_bytes(index));
+        }
+    }
+    std::size_t bpt = bpp*8;
+    std::array<uint8_t, retrogfx::TILE_WIDTH * retrogfx::TILE_HEIGHT> pixels;
+    data.resize((data.size() + bpt - 1) / bpt * bpt);
+    for (std::size_t i = 0; i < data.size(); i += bpt) {
+        retrogfx::decode_tile(std::span(data).subspan(i, bpt), bpp, format, pixels.data());
+        res.tiles.push_back(retrogfx::hash_tile(pixels));
+    }
+    for (auto ext : { ".pal", ".map" })
+        res.sides.push_back(hash_bytes(load(std::string(name) + ext)));
+    return res;
+}
+
+// converts to a temporary file next to the output, which is then renamed
+// over it, so that nothing reading the output ever sees half a file. if no
+// tile, palette or tilemap changed, the output isn't touched at all.
+void convert_asset(Asset &asset, const ConvertOptions &opts)
+{
+    auto start = std::chrono::steady_clock::now();
+    // same directory (a rename can't cross file systems) and same extension
+    // (which decides the output's kind)
+    auto out_path = std::filesystem::path(asset.output);
+    auto tmp = (out_path.parent_path() / ("." + out_path.filename().string() + ".tmp" + out_path.extension().string())).string();
+    std::vector<std::string> extras = { ".pal", ".map" };
+    auto remove_tmp = [&] {
+        std::remove(tmp.c_str());
+        for (auto &ext : extras)
+            std::remove((tmp + ext).c_str());
+    };
+    if (encode_image(asset.input, tmp, asset.bpp, asset.format, opts.max_tiles, opts.quantize) != 0) {
+        remove_tmp();
+        return;
+    }
+
+    auto hashes = hash_output(tmp, asset.bpp, asset.format);
+    auto &old = asset.hashes.tiles;
+    std::size_t changed = 0;
+    for (std::size_t i = 0; i < std::max(hashes.tiles.size(), old.size()); i++)
+        changed += i >= hashes.tiles.size() || i >= old.size() || hashes.tiles[i] != old[i];
+    bool sides_changed = hashes.sides != asset.hashes.sides;
+    if (changed == 0 && !sides_changed) {
+        remove_tmp();
+        fmt::print(stderr, "{}: nothing changed\n", asset.input);
+        return;
+    }
+    for (auto &ext : extras)
+        std::rename((tmp + ext).c_str(), (asset.output + ext).c_str());
+    if (std::rename(tmp.c_str(), asset.output.c_str()) != 0) {
+        fmt::print(stderr, "error: couldn't write to {}: ", asset.output);
+        std::perror("");
+        remove_tmp();
+        return;
+    }
+    asset.hashes = std::move(hashes);
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    fmt::print(stderr, "{}: {} of {} tiles changed{}, wrote {} ({:.1f} ms)\n",
+               asset.input, changed, asset.hashes.tiles.size(), sides_changed ? " (and the palette or tilemap)" : "",
+               asset.output, ms.count());
+}
+
+// a manifest lists one asset per line: input, output, and optionally bpp
+// and format, which otherwise default to the ones given with -b and -f.
+// paths are relative to the manifest. empty lines and lines starting with
+// # are skipped
+std::optional<std::vector<Asset>> read_manifest(std::string_view name, int bpp, retrogfx::Format format)
+{
+    std::ifstream file{std::string(name)};
+    if (!file) {
+        fmt::print(stderr, "error: couldn't open manifest {}\n", name);
+        return std::nullopt;
+    }
+    auto dir = std::filesystem::path(name).parent_path();
+    std::vector<Asset> assets;
+    std::string line;
+    for (int n = 1; std::getline(file, line); n++) {
+        std::istringstream words(line);
+        std::string input, output, bpp_str, format_str;
+        if (!(words >> input) || input[0] == '#')
+            continue;
+        words >> output >> bpp_str >> format_str;
+        auto b = bpp_str.empty() ? std::optional<int>(bpp) : to_number(bpp_str);
+        auto f = format_str.empty() ? std::optional(format) : retrogfx::string_to_format(format_str);
+        if (output.empty() || !b || !f || !retrogfx::format_supports_bpp(f.value(), b.value())) {
+            fmt::print(stderr, "error: {}:{}: expected \"input output [bpp] [format]\" "
+                               "(with a bpp the format can use)\n", name, n);
+            return std::nullopt;
+        }
+        assets.push_back({ (dir / input).string(), (dir / output).string(), b.value(), f.value(), {} });
+    }
+    return assets;
+}
+
+// keeps converting images as soon as they're saved. @input is either an
+// image, converted to @output, or a manifest (ending in .manifest), which
+// is itself watched too
+int watch_mode(std::string_view input, std::string_view output, int bpp, retrogfx::Format format,
+               const ConvertOptions &opts)
+{
+    const int DEBOUNCE_MS = 10;
+    watch::Watcher watcher;
+    if (!watcher.ok()) {
+        std::perror("error: couldn't start watching files");
+        return 1;
+    }
+    bool is_manifest = input.ends_with(".manifest");
+    std::vector<Asset> assets;
+
+    // convert everything that's out of date, then watch every input
+    auto load = [&] {
+        std::vector<Asset> loaded = { { std::string(input), std::string(output), bpp, format, {} } };
+        if (is_manifest) {
+            auto m = read_manifest(input, bpp, format);
+            if (!m)
+                return false;
+            loaded = std::move(m.value());
+        }
+        watcher.clear();
+        if (is_manifest)
+            watcher.add(std::string(input));
+        for (auto &asset : loaded) {
+            auto old = std::find_if(assets.begin(), assets.end(), [&](const Asset &a) {
+                return a.output == asset.output && a.bpp == asset.bpp && a.format == asset.format;
+            });
+            asset.hashes = old != assets.end() ? old->hashes : hash_output(asset.output, asset.bpp, asset.format);
+            if (old == assets.end() || old->input != asset.input)
+                convert_asset(asset, opts);
+            if (!watcher.add(asset.input))
+                fmt::print(stderr, "warning: couldn't watch {}\n", asset.input);
+        }
+        assets = std::move(loaded);
+        return true;
+    };
+    if (!load())
+        return 1;
+    fmt::print(stderr, "watching {} file(s), press Ctrl+C to stop\n", assets.size());
+
+    for (;;) {
+        auto changed = watcher.wait(DEBOUNCE_MS);
+        if (is_manifest && std::find(changed.begin(), changed.end(), watch::Watcher::name(std::string(input))) != changed.end())
+            load();
+        for (auto &asset : assets)
+            if (std::find(changed.begin(), changed.end(), watch::Watcher::name(asset.input)) != changed.end())
+                convert_asset(asset, opts);
+    }
+}
+
 std::optional<int> parse_bpp(cmdline::Result &result)
 {
     if (!result.has('b'))
@@ -133,6 +927,19 @@ std::optional<int> parse_bpp(cmdline::Result &result)
     return num;
 }
 
+std::optional<std::size_t> parse_max_tiles(cmdline::Result &result)
+{
+    if (!result.has('t'))
+        return std::nullopt;
+    auto &p = result.params['t'];
+    auto num = to_number(p);
+    if (!num || num.value() <= 0) {
+        fmt::print(stderr, "warning: invalid value {} for -t (tiles won't be reduced)\n", p);
+        return std::nullopt;
+    }
+    return num.value();
+}
+
 std::optional<retrogfx::Format> parse_format(cmdline::Result &result)
 {
     if (result.has('f')) {
@@ -149,33 +956,42 @@ using cmdline::ParamType;
 
 static const cmdline::Argument arglist[] = {
     { 'h', "help",      "show this help text"                                      },
-    { 'o', "output",    "FILENAME: output to FILENAME",          ParamType::Single },
+    { 'o', "output",    "FILENAME: output to FILENAME (- for stdout, .rgfx for a container, .qoi for QOI)", ParamType::Single },
     { 'r', "reverse",   "convert from image to chr"                                },
     { 'b', "bpp",       "NUMBER: specify bpp (bits per pixel)",  ParamType::Single },
-    { 'f', "format", "(planar | interwined): specify format",    ParamType::Single },
+    { 'f', "format", "(planar | interwined | gba | ps1 | n64 | vb | ngp): specify format", ParamType::Single },
+    { 'n', "nes",       "convert to a NES background (writes FILENAME.nam and FILENAME.pal)" },
+    { 'q', "quantize",  "build a palette from the image (writes FILENAME.pal)"   },
+    { 't', "max-tiles", "NUMBER: reduce tiles to at most NUMBER (writes FILENAME.map)", ParamType::Single },
+    { 'a', "autotune",  "FILENAME: tune decoding for this machine, caching results in FILENAME", ParamType::Single },
+    { 'i', "interleave", "LAYOUT: read every file as a single ROM set (byte, word, interleave=N, swap, swap32, smd; comma separated)", ParamType::Single },
+    { 's', "bits",      "OFFSET[,STRIDE]: tiles start at bit OFFSET and are STRIDE bits apart (default bpp*64); with -r, keeps the other bits of an existing output", ParamType::Single },
+    { 'w', "watch",     "with -r, convert again whenever the image (or a .manifest of images) changes" },
 };
 
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
-        fmt::print(stderr, "usage: converter [file...]\n");
+        fmt::print(stderr, "usage: converter [file...] (- for stdin)\n");
         cmdline::print_args(arglist);
         return 1;
     }
 
     auto result = cmdline::parse(argc, argv, arglist);
     if (result.has('h')) {
-        fmt::print(stderr, "usage: converter [file...]\n");
+        fmt::print(stderr, "usage: converter [file...] (- for stdin)\n");
+        fmt::print(stderr, "files can also be ARCHIVE.zip:MEMBER, or ARCHIVE.zip to decode every member\n"
+                           "into a directory (named after the archive if -o isn't given)\n");
         cmdline::print_args(arglist);
         return 0;
     }
 
     if (result.items.size() == 0) {
         fmt::print(stderr, "error: no file specified\n");
-        fmt::print(stderr, "usage: converter [file...]\n");
+        fmt::print(stderr, "usage: converter [file...] (- for stdin)\n");
         cmdline::print_args(arglist);
         return 1;
-    } else if (result.items.size() > 1) {
+    } else if (result.items.size() > 1 && !result.has('i')) {
         fmt::print(stderr, "error: too many files specified (only first will be used)\n");
     }
 
@@ -187,7 +1003,66 @@ int main(int argc, char *argv[])
                 :                       "output.bin";
     int bpp = parse_bpp(result).value_or(2);
     retrogfx::Format format = parse_format(result).value_or(retrogfx::Format::Planar);
+    auto max_tiles = parse_max_tiles(result);
+    if (!retrogfx::format_supports_bpp(format, bpp)) {
+        fmt::print(stderr, "error: format {} can't use {} bpp\n", retrogfx::format_to_string(format).value(), bpp);
+        return 1;
+    }
 
+    if (output == "-" && mode == Mode::ToBin && (result.has('n') || result.has('q') || result.has('t'))) {
+        fmt::print(stderr, "error: -n, -q and -t need an output file name\n");
+        return 1;
+    }
+    if (result.has('a'))
+        retrogfx::autotune(result.params['a']);
+    if (result.has('w')) {
+        if (mode != Mode::ToBin || result.has('n') || input == "-" || output == "-") {
+            fmt::print(stderr, "error: -w only works with -r, without -n, on files\n");
+            return 1;
+        }
+        return watch_mode(input, output, bpp, format, { max_tiles, result.has('q') });
+    }
+    if (result.has('s')) {
+        std::string_view param = result.params['s'];
+        auto comma = param.find(',');
+        auto offset = to_number<std::size_t>(param.substr(0, comma));
+        auto stride = comma == param.npos ? std::optional<std::size_t>(bpp*64)
+                                          : to_number<std::size_t>(param.substr(comma + 1));
+        if (!offset || !stride || stride.value() < std::size_t(bpp*64)) {
+            fmt::print(stderr, "error: invalid value {} for -s (the stride must be at least bpp*64)\n", param);
+            return 1;
+        }
+        if (mode == Mode::ToBin && (result.has('n') || result.has('q') || result.has('t'))) {
+            fmt::print(stderr, "error: -s can't be used with -n, -q or -t\n");
+            return 1;
+        }
+        return mode == Mode::ToImg ? decode_bits(input, output, offset.value(), stride.value(), bpp, format)
+                                   : encode_bits(input, output, offset.value(), stride.value(), bpp, format);
+    }
+    if (result.has('i')) {
+        auto layout = romset::parse_layout(result.params['i']);
+        if (mode != Mode::ToImg) {
+            fmt::print(stderr, "error: -i can't be used with -r\n");
+            return 1;
+        }
+        if (!layout) {
+            fmt::print(stderr, "error: invalid layout {} for -i\n", result.params['i']);
+            return 1;
+        }
+        return decode_romset(result.items, layout.value(), output, bpp, format);
+    }
+    if (mode == Mode::ToBin && (input.ends_with(".zip") || input.find(".zip:") != std::string_view::npos)) {
+        fmt::print(stderr, "error: zip archives can only be read, not written to\n");
+        return 1;
+    }
+    if (mode == Mode::ToImg && input.find(".zip:") != std::string_view::npos)
+        return decode_zip_member(input, output, bpp, format);
+    if (mode == Mode::ToImg && input.ends_with(".zip"))
+        return decode_zip_archive(input, result.has('o') ? output : input.substr(0, input.size() - 4), bpp, format);
+    if (mode == Mode::ToImg && input.ends_with(".rgfx"))
+        return decode_container(input, output);
+    if (mode == Mode::ToBin && result.has('n'))
+        return encode_nes_background(input, output);
     return mode == Mode::ToImg ? decode_to_image(input, output, bpp, format)
-                               : encode_image(   input, output, bpp, format);
+                               : encode_image(   input, output, bpp, format, max_tiles, result.has('q'));
 }
@@ -0,0 +1,503 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <span>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+// a small zlib (deflate) stream compressor and decompressor, enough to
+// read and write PNG files (and read zip archives) without pulling in
+// external libraries.
+// the compressor only emits fixed huffman blocks, with greedy LZ77
+// matching over a 32K window; the decompressor handles any stream.
+namespace deflate {
+
+const std::size_t WINDOW_SIZE = 32768;
+const std::size_t BLOCK_SIZE  = 65536;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+const int HASH_BITS = 15;
+const int MAX_CHAIN = 32;
+const int MAX_BITS = 15;
+
+namespace detail {
+    inline const std::array<uint16_t, 29> length_base = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    inline const std::array<uint8_t, 29> length_extra = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    inline const std::array<uint16_t, 30> dist_base = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    inline const std::array<uint8_t, 30> dist_extra = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    inline uint32_t reverse(uint32_t code, int len)
+    {
+        uint32_t res = 0;
+        for (int i = 0; i < len; i++, code >>= 1)
+            res = res << 1 | (code & 1);
+        return res;
+    }
+
+    // order in which code length code lengths are stored in dynamic blocks
+    inline const std::array<uint8_t, 19> clen_order = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+
+    inline uint32_t hash3(const uint8_t *p)
+    {
+        uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    inline const std::array<uint32_t, 256> crc_table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+} // namespace detail
+
+// the CRC-32 used by PNG chunks and zip archives
+inline uint32_t crc32(uint32_t crc, std::span<const uint8_t> data)
+{
+    crc = ~crc;
+    for (auto b : data)
+        crc = detail::crc_table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t adler32(uint32_t adler, std::span<const uint8_t> data)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    for (std::size_t i = 0; i < data.size(); ) {
+        // 5552 is the largest n such that the sums can't overflow
+        auto end = std::min(data.size(), i + 5552);
+        for ( ; i < end; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+class Compressor {
+    std::function<void(std::span<const uint8_t>)> output;
+    // input not yet compressed, preceded by up to WINDOW_SIZE bytes of history
+    std::vector<uint8_t> buf;
+    std::size_t start = 0;
+    std::vector<int> head, prev;
+    std::vector<uint8_t> out;
+    uint64_t bits = 0;
+    int num_bits = 0;
+    uint32_t adler = 1;
+
+    void put_bits(uint32_t value, int len)
+    {
+        bits |= uint64_t(value) << num_bits;
+        num_bits += len;
+        while (num_bits >= 8) {
+            out.push_back(bits & 0xFF);
+            bits >>= 8;
+            num_bits -= 8;
+        }
+    }
+
+    // huffman codes are stored starting from their most significant bit
+    void put_literal(int lit)
+    {
+        if (lit < 144)      put_bits(detail::reverse(0x30  + lit,       8), 8);
+        else if (lit < 256) put_bits(detail::reverse(0x190 + lit - 144, 9), 9);
+        else if (lit < 280) put_bits(detail::reverse(lit - 256,         7), 7);
+        else                put_bits(detail::reverse(0xC0  + lit - 280, 8), 8);
+    }
+
+    void put_match(int len, int dist)
+    {
+        int l = std::upper_bound(detail::length_base.begin(), detail::length_base.end(), len)
+              - detail::length_base.begin() - 1;
+        put_literal(257 + l);
+        put_bits(len - detail::length_base[l], detail::length_extra[l]);
+        int d = std::upper_bound(detail::dist_base.begin(), detail::dist_base.end(), dist)
+              - detail::dist_base.begin() - 1;
+        put_bits(detail::reverse(d, 5), 5);
+        put_bits(dist - detail::dist_base[d], detail::dist_extra[d]);
+    }
+
+    void insert(std::size_t pos)
+    {
+        auto h = detail::hash3(&buf[pos]);
+        prev[pos] = head[h];
+        head[h] = pos;
+    }
+
+    int longest_match(std::size_t pos, int &dist)
+    {
+        int best = 0;
+        int max_len = std::min<std::size_t>(MAX_MATCH, buf.size() - pos);
+        int cand = head[detail::hash3(&buf[pos])];
+        for (int chain = 0; cand >= 0 && pos - cand <= WINDOW_SIZE && chain < MAX_CHAIN; chain++) {
+            int len = 0;
+            while (len < max_len && buf[cand + len] == buf[pos + len])
+                len++;
+            if (len > best) {
+                best = len;
+                dist = pos - cand;
+                if (len == max_len)
+                    break;
+            }
+            cand = prev[cand];
+        }
+        return best;
+    }
+
+    void compress_block(bool last)
+    {
+        put_bits(last, 1);
+        put_bits(1, 2);
+        prev.resize(buf.size());
+        std::size_t pos = start;
+        while (pos < buf.size()) {
+            int dist = 0;
+            int len = buf.size() - pos >= MIN_MATCH ? longest_match(pos, dist) : 0;
+            if (len >= MIN_MATCH) {
+                put_match(len, dist);
+                for (auto end = pos + len; pos < end; pos++)
+                    if (buf.size() - pos >= MIN_MATCH)
+                        insert(pos);
+            } else {
+                put_literal(buf[pos]);
+                if (buf.size() - pos >= MIN_MATCH)
+                    insert(pos);
+                pos++;
+            }
+        }
+        put_literal(256);
+        start = buf.size();
+    }
+
+    // drops everything except the last WINDOW_SIZE bytes, moving hash
+    // chains along with the data
+    void slide()
+    {
+        if (buf.size() <= WINDOW_SIZE)
+            return;
+        int shift = buf.size() - WINDOW_SIZE;
+        auto move = [&](int p) { return p >= shift ? p - shift : -1; };
+        for (auto &h : head)
+            h = move(h);
+        for (std::size_t i = 0; i < WINDOW_SIZE; i++)
+            prev[i] = move(prev[i + shift]);
+        buf.erase(buf.begin(), buf.begin() + shift);
+        prev.resize(WINDOW_SIZE);
+        start = buf.size();
+    }
+
+    void flush_output()
+    {
+        if (!out.empty())
+            output(out);
+        out.clear();
+    }
+
+public:
+    explicit Compressor(std::function<void(std::span<const uint8_t>)> output)
+        : output(output), head(1 << HASH_BITS, -1)
+    {
+        // zlib header: deflate with a 32K window, no dictionary
+        put_bits(0x78, 8);
+        put_bits(0x01, 8);
+    }
+
+    void write(std::span<const uint8_t> data)
+    {
+        adler = adler32(adler, data);
+        buf.insert(buf.end(), data.begin(), data.end());
+        if (buf.size() - start >= BLOCK_SIZE) {
+            compress_block(false);
+            slide();
+            flush_output();
+        }
+    }
+
+    void finish()
+    {
+        compress_block(true);
+        if (num_bits > 0)
+            put_bits(0, 8 - num_bits);
+        for (int i = 3; i >= 0; i--)
+            put_bits(adler >> (i*8) & 0xFF, 8);
+        flush_output();
+    }
+};
+
+// pulls compressed data from @input as needed: output is produced a
+// chunk at a time by read(), keeping only the 32K window in memory.
+class Decompressor {
+    std::function<std::size_t(std::span<uint8_t>)> input;
+    std::array<uint8_t, 4096> inbuf;
+    std::size_t in_pos = 0, in_len = 0;
+    uint64_t bits = 0;
+    int num_bits = 0;
+    bool input_ended = false;
+    int padding = 0;
+
+    std::vector<uint8_t> window = std::vector<uint8_t>(WINDOW_SIZE);
+    std::size_t window_pos = 0;
+    std::size_t total_out = 0;      // matches can't reach back past the start
+
+    // lookup tables, indexed by the next max_len bits of input.
+    // each entry is symbol << 4 | code length (0 for invalid codes)
+    struct Table {
+        std::vector<uint16_t> entries;
+        int max_len = 0;
+    } lit_table, dist_table;
+
+    enum class State { Header, BlockStart, Stored, Huffman, Done, Error } state = State::Header;
+    bool last_block = false;
+    std::size_t stored_left = 0;
+    int match_len = 0, match_dist = 0;
+
+    // once the input ends, zeros are shifted in so that the last code can
+    // still be looked up; actually consuming them is an error
+    void need(int n)
+    {
+        while (num_bits < n) {
+            if (in_pos == in_len && !input_ended) {
+                in_len = input(inbuf);
+                in_pos = 0;
+                input_ended = in_len == 0;
+            }
+            if (input_ended)
+                padding += 8;
+            else
+                bits |= uint64_t(inbuf[in_pos++]) << num_bits;
+            num_bits += 8;
+        }
+    }
+
+    uint32_t get_bits(int n)
+    {
+        need(n);
+        uint32_t v = bits & ((uint64_t(1) << n) - 1);
+        bits >>= n;
+        num_bits -= n;
+        return v;
+    }
+
+    bool build(Table &t, std::span<const uint8_t> lengths)
+    {
+        std::array<int, MAX_BITS+1> count = {}, next = {};
+        for (auto l : lengths)
+            count[l]++;
+        count[0] = 0;
+        t.max_len = 1;
+        for (int l = 1; l <= MAX_BITS; l++) {
+            next[l] = (next[l-1] + count[l-1]) << 1;
+            if (count[l] != 0)
+                t.max_len = l;
+        }
+        t.entries.assign(std::size_t(1) << t.max_len, 0);
+        for (std::size_t sym = 0; sym < lengths.size(); sym++) {
+            int l = lengths[sym];
+            if (l == 0)
+                continue;
+            auto code = detail::reverse(next[l]++, l);
+            if (code >= (1u << l))
+                return false;
+            for (auto i = code; i < t.entries.size(); i += 1u << l)
+                t.entries[i] = sym << 4 | l;
+        }
+        return true;
+    }
+
+    int decode(const Table &t)
+    {
+        need(t.max_len);
+        auto e = t.entries[bits & ((uint64_t(1) << t.max_len) - 1)];
+        int l = e & 0xF;
+        if (l == 0 || l > num_bits)
+            return -1;
+        bits >>= l;
+        num_bits -= l;
+        return e >> 4;
+    }
+
+    void fixed_tables()
+    {
+        std::array<uint8_t, 288> lit;
+        std::fill(lit.begin(),       lit.begin() + 144, 8);
+        std::fill(lit.begin() + 144, lit.begin() + 256, 9);
+        std::fill(lit.begin() + 256, lit.begin() + 280, 7);
+        std::fill(lit.begin() + 280, lit.end(),         8);
+        std::array<uint8_t, 30> dist;
+        dist.fill(5);
+        build(lit_table, lit);
+        build(dist_table, dist);
+    }
+
+    bool dynamic_tables()
+    {
+        int hlit = get_bits(5) + 257, hdist = get_bits(5) + 1, hclen = get_bits(4) + 4;
+        std::array<uint8_t, 19> clens = {};
+        for (int i = 0; i < hclen; i++)
+            clens[detail::clen_order[i]] = get_bits(3);
+        Table clen_table;
+        if (!build(clen_table, clens))
+            return false;
+        std::array<uint8_t, 288 + 32> lengths = {};
+        for (int i = 0; i < hlit + hdist; ) {
+            int sym = decode(clen_table);
+            if (sym < 0)
+                return false;
+            if (sym < 16) {
+                lengths[i++] = sym;
+                continue;
+            }
+            int len = 0, rep;
+            if (sym == 16) {
+                if (i == 0)
+                    return false;
+                len = lengths[i-1];
+                rep = 3 + get_bits(2);
+            } else if (sym == 17) {
+                rep = 3 + get_bits(3);
+            } else {
+                rep = 11 + get_bits(7);
+            }
+            if (i + rep > hlit + hdist)
+                return false;
+            while (rep--)
+                lengths[i++] = len;
+        }
+        return build(lit_table, std::span(lengths).first(hlit))
+            && build(dist_table, std::span(lengths).subspan(hlit, hdist));
+    }
+
+    bool start_block()
+    {
+        last_block = get_bits(1);
+        switch (get_bits(2)) {
+        case 0: {
+            // stored blocks start at a byte boundary
+            get_bits(num_bits % 8);
+            auto len  = get_bits(16);
+            auto nlen = get_bits(16);
+            if (len != (~nlen & 0xFFFF))
+                return false;
+            stored_left = len;
+            state = State::Stored;
+            return true;
+        }
+        case 1: fixed_tables(); state = State::Huffman; return true;
+        case 2: state = State::Huffman; return dynamic_tables();
+        default: return false;
+        }
+    }
+
+    void put(uint8_t b, std::span<uint8_t> out, std::size_t &n)
+    {
+        out[n++] = b;
+        total_out++;
+        window[window_pos] = b;
+        window_pos = (window_pos + 1) % WINDOW_SIZE;
+    }
+
+    void end_block()
+    {
+        state = last_block ? State::Done : State::BlockStart;
+    }
+
+public:
+    // @zlib is false for raw deflate streams, without zlib's header (such
+    // as the ones inside zip archives)
+    explicit Decompressor(std::function<std::size_t(std::span<uint8_t>)> input, bool zlib = true)
+        : input(input), state(zlib ? State::Header : State::BlockStart)
+    { }
+
+    // fills @out with decompressed data, returning how many bytes were
+    // written. returns less than out.size() only at the end of the stream
+    // or on errors.
+    std::size_t read(std::span<uint8_t> out)
+    {
+        std::size_t n = 0;
+        while (n < out.size()) {
+            if (num_bits < padding)
+                state = State::Error;
+            switch (state) {
+            case State::Header: {
+                auto cmf = get_bits(8), flg = get_bits(8);
+                bool ok = (cmf & 0xF) == 8 && (cmf << 8 | flg) % 31 == 0 && !(flg & 0x20);
+                state = ok ? State::BlockStart : State::Error;
+                break;
+            }
+            case State::BlockStart:
+                if (!start_block())
+                    state = State::Error;
+                break;
+            case State::Stored:
+                if (stored_left == 0) {
+                    end_block();
+                    break;
+                }
+                put(get_bits(8), out, n);
+                stored_left--;
+                break;
+            case State::Huffman: {
+                if (match_len > 0) {
+                    for ( ; match_len > 0 && n < out.size(); match_len--)
+                        put(window[(window_pos + WINDOW_SIZE - match_dist) % WINDOW_SIZE], out, n);
+                    break;
+                }
+                int sym = decode(lit_table);
+                if (sym < 0 || sym > 285) {
+                    state = State::Error;
+                } else if (sym < 256) {
+                    put(sym, out, n);
+                } else if (sym == 256) {
+                    end_block();
+                } else {
+                    sym -= 257;
+                    match_len = detail::length_base[sym] + get_bits(detail::length_extra[sym]);
+                    int d = decode(dist_table);
+                    if (d < 0 || d >= 30) {
+                        state = State::Error;
+                        break;
+                    }
+                    match_dist = detail::dist_base[d] + get_bits(detail::dist_extra[d]);
+                    if (std::size_t(match_dist) > total_out) {
+                        match_len = 0;
+                        state = State::Error;
+                    }
+                }
+                break;
+            }
+            case State::Done:
+            case State::Error:
+                return n;
+            }
+        }
+        return n;
+    }
+
+    bool done() const { return state == State::Done; }
+    bool error() const { return state == State::Error; }
+};
+
+} // namespace deflate
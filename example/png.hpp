@@ -0,0 +1,316 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <span>
+#include <vector>
+#include "deflate.hpp"
+
+// a PNG reader and writer that work one row at a time, so that an image
+// never needs to be fully in memory. rows always have 8-bit channels: gray,
+// gray + alpha, RGB or RGBA (i.e. 1 to 4 channels, like stb_image).
+namespace png {
+
+const std::size_t IDAT_SIZE = 65536;
+
+namespace detail {
+    inline void put32(std::vector<uint8_t> &v, uint32_t x)
+    {
+        for (int i = 3; i >= 0; i--)
+            v.push_back(x >> (i*8) & 0xFF);
+    }
+
+    inline void write_chunk(FILE *f, const char *type, std::span<const uint8_t> data)
+    {
+        std::vector<uint8_t> chunk;
+        put32(chunk, data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        // the crc covers the type and the data, not the length
+        put32(chunk, deflate::crc32(0, std::span(chunk).subspan(4)));
+        std::fwrite(chunk.data(), 1, chunk.size(), f);
+    }
+
+    inline uint8_t color_type(int channels)
+    {
+        switch (channels) {
+        case 1:  return 0;
+        case 2:  return 4;
+        case 3:  return 2;
+        default: return 6;
+        }
+    }
+} // namespace detail
+
+class Writer {
+    FILE *file;
+    std::size_t row_size;
+    std::vector<uint8_t> idat, filtered;
+    deflate::Compressor compressor;
+
+    void flush(std::size_t min_size)
+    {
+        if (idat.size() >= min_size && !idat.empty()) {
+            detail::write_chunk(file, "IDAT", idat);
+            idat.clear();
+        }
+    }
+
+public:
+    // writes the header right away: @width and @height must be known
+    Writer(FILE *file, std::size_t width, std::size_t height, int channels)
+        : file(file), row_size(width * channels), filtered(row_size + 1),
+          compressor([this](std::span<const uint8_t> data) {
+              idat.insert(idat.end(), data.begin(), data.end());
+              flush(IDAT_SIZE);
+          })
+    {
+        static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        std::fwrite(signature, 1, sizeof(signature), file);
+        std::vector<uint8_t> ihdr;
+        detail::put32(ihdr, width);
+        detail::put32(ihdr, height);
+        ihdr.insert(ihdr.end(), { 8, detail::color_type(channels), 0, 0, 0 });
+        detail::write_chunk(file, "IHDR", ihdr);
+    }
+
+    // rows must be written top to bottom, each one width * channels bytes.
+    // they're stored without filtering, which suits flat indexed art well
+    void write_row(std::span<const uint8_t> row)
+    {
+        filtered[0] = 0;
+        std::copy(row.begin(), row.begin() + row_size, filtered.begin() + 1);
+        compressor.write(filtered);
+    }
+
+    // must be called after the last row
+    void finish()
+    {
+        compressor.finish();
+        flush(0);
+        detail::write_chunk(file, "IEND", {});
+    }
+};
+
+// reads rows on demand, inflating and unfiltering only what's needed for
+// the next row. palettes, bit depths below 8 and 16-bit images are expanded
+// the same way stb_image does. interlaced images aren't supported.
+class Reader {
+    FILE *file;
+    std::vector<uint8_t> header_bytes;
+    bool valid = false;
+    uint32_t img_width = 0, img_height = 0;
+    int depth = 0, color = 0, out_channels = 0;
+    std::vector<std::array<uint8_t, 4>> palette;
+    std::array<uint16_t, 3> trns = {};
+    bool has_trns = false;
+    std::size_t chunk_left = 0;
+    bool idat_ended = false;
+    std::size_t stride = 0, pixel_bytes = 0;
+    std::vector<uint8_t> prev, cur;
+    deflate::Decompressor inflater;
+    uint32_t rows_read = 0;
+
+    bool read_header(void *p, std::size_t n)
+    {
+        auto b = static_cast<uint8_t *>(p);
+        if (std::fread(b, 1, n, file) != n)
+            return false;
+        header_bytes.insert(header_bytes.end(), b, b + n);
+        return true;
+    }
+
+    static uint32_t get32(const uint8_t *p)
+    {
+        return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+
+    // the data of all IDAT chunks, as if it were a single stream
+    std::size_t read_idat(std::span<uint8_t> buf)
+    {
+        while (chunk_left == 0 && !idat_ended) {
+            uint8_t h[12];
+            if (std::fread(h, 1, 12, file) != 12 || std::memcmp(h + 8, "IDAT", 4) != 0)
+                idat_ended = true;
+            else
+                chunk_left = get32(h + 4);
+        }
+        if (idat_ended)
+            return 0;
+        auto n = std::fread(buf.data(), 1, std::min(buf.size(), chunk_left), file);
+        chunk_left = n == 0 ? 0 : chunk_left - n;
+        idat_ended = n == 0;
+        return n;
+    }
+
+    bool parse()
+    {
+        static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        uint8_t sig[8];
+        if (!read_header(sig, 8) || std::memcmp(sig, signature, 8) != 0)
+            return false;
+        for (bool first = true; ; first = false) {
+            uint8_t h[8];
+            if (!read_header(h, 8))
+                return false;
+            uint32_t len = get32(h);
+            if (std::memcmp(h + 4, "IDAT", 4) == 0) {
+                chunk_left = len;
+                return !first;
+            }
+            if (std::memcmp(h + 4, "IEND", 4) == 0 || len > (1u << 24))
+                return false;
+            std::vector<uint8_t> data(len + 4);
+            if (!read_header(data.data(), data.size()))
+                return false;
+            if (first != (std::memcmp(h + 4, "IHDR", 4) == 0))
+                return false;
+            if (first) {
+                if (len != 13)
+                    return false;
+                img_width  = get32(&data[0]);
+                img_height = get32(&data[4]);
+                depth = data[8];
+                color = data[9];
+                // compression, filter method and interlacing
+                if (data[10] != 0 || data[11] != 0 || data[12] != 0)
+                    return false;
+            } else if (std::memcmp(h + 4, "PLTE", 4) == 0) {
+                for (std::size_t i = 0; i + 2 < len; i += 3)
+                    palette.push_back({ data[i], data[i+1], data[i+2], 0xFF });
+            } else if (std::memcmp(h + 4, "tRNS", 4) == 0) {
+                has_trns = true;
+                if (color == 3)
+                    for (std::size_t i = 0; i < len && i < palette.size(); i++)
+                        palette[i][3] = data[i];
+                else
+                    for (std::size_t i = 0; i < 3 && i*2 + 1 < len; i++)
+                        trns[i] = data[i*2] << 8 | data[i*2+1];
+            }
+        }
+    }
+
+    int sample(std::size_t i) const
+    {
+        const uint8_t *line = &cur[1];
+        switch (depth) {
+        case 8:  return line[i];
+        case 16: return line[i*2] << 8 | line[i*2+1];
+        default: return line[i * depth / 8] >> (8 - depth - i * depth % 8) & ((1 << depth) - 1);
+        }
+    }
+
+    uint8_t to8(int v) const
+    {
+        return depth == 16 ? v >> 8
+             : depth == 8  ? v
+             :               v * (255 / ((1 << depth) - 1));
+    }
+
+    void unfilter()
+    {
+        uint8_t *line = &cur[1], *up = &prev[1];
+        auto left = [&](std::size_t i) { return i >= pixel_bytes ? line[i - pixel_bytes] : 0; };
+        auto upleft = [&](std::size_t i) { return i >= pixel_bytes ? up[i - pixel_bytes] : 0; };
+        for (std::size_t i = 0; i < stride; i++) {
+            switch (cur[0]) {
+            case 1: line[i] += left(i); break;
+            case 2: line[i] += up[i]; break;
+            case 3: line[i] += (left(i) + up[i]) / 2; break;
+            case 4: {
+                int a = left(i), b = up[i], c = upleft(i);
+                int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                line[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default: break;
+            }
+        }
+    }
+
+public:
+    // reads everything up to the image data. if the file isn't a PNG or
+    // can't be streamed, ok() returns false and consumed() has the bytes
+    // read so far, so that another decoder can take over.
+    explicit Reader(FILE *file)
+        : file(file),
+          inflater([this](std::span<uint8_t> buf) { return read_idat(buf); })
+    {
+        if (!parse())
+            return;
+        int samples = 0;
+        switch (color) {
+        case 0: samples = 1; out_channels = has_trns ? 2 : 1; break;
+        case 2: samples = 3; out_channels = has_trns ? 4 : 3; break;
+        case 3: samples = 1; out_channels = has_trns ? 4 : 3; break;
+        case 4: samples = 2; out_channels = 2; break;
+        case 6: samples = 4; out_channels = 4; break;
+        default: return;
+        }
+        bool depth_ok = color == 0 ? depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16
+                      : color == 3 ? depth == 1 || depth == 2 || depth == 4 || depth == 8
+                      :              depth == 8 || depth == 16;
+        if (!depth_ok || (color == 3 && palette.empty()) || img_width == 0)
+            return;
+        stride = (std::size_t(img_width) * samples * depth + 7) / 8;
+        pixel_bytes = std::max(1, samples * depth / 8);
+        prev.assign(stride + 1, 0);
+        cur.assign(stride + 1, 0);
+        valid = true;
+    }
+
+    bool ok() const { return valid; }
+    std::span<const uint8_t> consumed() const { return header_bytes; }
+    std::size_t width() const { return img_width; }
+    std::size_t height() const { return img_height; }
+    int channels() const { return out_channels; }
+
+    // @row must have room for width() * channels() bytes. returns false
+    // after the last row or on errors.
+    bool read_row(std::span<uint8_t> row)
+    {
+        if (!valid || rows_read == img_height || inflater.read(cur) != cur.size() || cur[0] > 4)
+            return false;
+        unfilter();
+        auto out = row.begin();
+        for (std::size_t x = 0; x < img_width; x++) {
+            switch (color) {
+            case 0: {
+                int v = sample(x);
+                *out++ = to8(v);
+                if (has_trns)
+                    *out++ = v == trns[0] ? 0 : 0xFF;
+                break;
+            }
+            case 2: {
+                int r = sample(x*3), g = sample(x*3+1), b = sample(x*3+2);
+                *out++ = to8(r);
+                *out++ = to8(g);
+                *out++ = to8(b);
+                if (has_trns)
+                    *out++ = r == trns[0] && g == trns[1] && b == trns[2] ? 0 : 0xFF;
+                break;
+            }
+            case 3: {
+                std::size_t i = sample(x);
+                auto c = i < palette.size() ? palette[i] : std::array<uint8_t, 4>{};
+                out = std::copy(c.begin(), c.begin() + out_channels, out);
+                break;
+            }
+            default:
+                for (int c = 0; c < out_channels; c++)
+                    *out++ = to8(sample(x * out_channels + c));
+            }
+        }
+        std::swap(prev, cur);
+        rows_read++;
+        return true;
+    }
+};
+
+} // namespace png
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <span>
+#include <vector>
+
+// a QOI ("Quite OK Image") reader and writer, working one row at a time
+// like the ones in png.hpp. QOI is lossless like PNG but much simpler and
+// faster, which suits intermediate files. QOI images have 3 (RGB) or 4
+// (RGBA) channels: gray images are written as RGB, gray + alpha as RGBA.
+namespace qoi {
+
+const std::size_t BUFFER_SIZE = 65536;
+
+namespace detail {
+    enum : uint8_t {
+        OP_INDEX = 0x00,
+        OP_DIFF  = 0x40,
+        OP_LUMA  = 0x80,
+        OP_RUN   = 0xC0,
+        OP_RGB   = 0xFE,
+        OP_RGBA  = 0xFF,
+        OP_MASK  = 0xC0,
+    };
+
+    const uint8_t END_MARKER[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    const int MAX_RUN = 62;
+
+    struct Pixel {
+        uint8_t r = 0, g = 0, b = 0, a = 0;
+        bool operator==(const Pixel &) const = default;
+    };
+
+    inline int hash(Pixel p) { return (p.r*3 + p.g*5 + p.b*7 + p.a*11) % 64; }
+
+    inline void put32(std::vector<uint8_t> &v, uint32_t x)
+    {
+        for (int i = 3; i >= 0; i--)
+            v.push_back(x >> (i*8) & 0xFF);
+    }
+
+    // QOI's channels for an image with @channels channels
+    inline int qoi_channels(int channels) { return channels == 2 || channels == 4 ? 4 : 3; }
+} // namespace detail
+
+class Writer {
+    FILE *file;
+    std::size_t width;
+    int channels;
+    std::vector<uint8_t> buf;
+    std::array<detail::Pixel, 64> index = {};
+    detail::Pixel prev = { 0, 0, 0, 0xFF };
+    int run = 0;
+
+    void flush(std::size_t min_size)
+    {
+        if (buf.size() >= min_size && !buf.empty()) {
+            std::fwrite(buf.data(), 1, buf.size(), file);
+            buf.clear();
+        }
+    }
+
+    void end_run()
+    {
+        if (run > 0)
+            buf.push_back(detail::OP_RUN | (run - 1));
+        run = 0;
+    }
+
+    void write_pixel(detail::Pixel px)
+    {
+        using namespace detail;
+        if (px == prev) {
+            if (++run == MAX_RUN)
+                end_run();
+            return;
+        }
+        end_run();
+        int h = hash(px);
+        if (index[h] == px) {
+            buf.push_back(OP_INDEX | h);
+            prev = px;
+            return;
+        }
+        index[h] = px;
+        if (px.a != prev.a) {
+            buf.insert(buf.end(), { OP_RGBA, px.r, px.g, px.b, px.a });
+            prev = px;
+            return;
+        }
+        // differences wrap around, as the decoder's sums do
+        int8_t dr = px.r - prev.r, dg = px.g - prev.g, db = px.b - prev.b;
+        int8_t dr_dg = dr - dg, db_dg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            buf.push_back(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            buf.insert(buf.end(), { uint8_t(OP_LUMA | (dg + 32)), uint8_t((dr_dg + 8) << 4 | (db_dg + 8)) });
+        else
+            buf.insert(buf.end(), { OP_RGB, px.r, px.g, px.b });
+        prev = px;
+    }
+
+public:
+    // writes the header right away: @width and @height must be known
+    Writer(FILE *file, std::size_t width, std::size_t height, int channels)
+        : file(file), width(width), channels(channels)
+    {
+        buf.insert(buf.end(), { 'q', 'o', 'i', 'f' });
+        detail::put32(buf, width);
+        detail::put32(buf, height);
+        buf.push_back(detail::qoi_channels(channels));
+        buf.push_back(0);   // sRGB with linear alpha
+    }
+
+    // rows must be written top to bottom, each one width * channels bytes
+    void write_row(std::span<const uint8_t> row)
+    {
+        for (std::size_t x = 0; x < width; x++) {
+            auto p = &row[x * channels];
+            switch (channels) {
+            case 1:  write_pixel({ p[0], p[0], p[0], 0xFF }); break;
+            case 2:  write_pixel({ p[0], p[0], p[0], p[1] }); break;
+            case 3:  write_pixel({ p[0], p[1], p[2], 0xFF }); break;
+            default: write_pixel({ p[0], p[1], p[2], p[3] }); break;
+            }
+        }
+        flush(BUFFER_SIZE);
+    }
+
+    // must be called after the last row
+    void finish()
+    {
+        end_run();
+        buf.insert(buf.end(), std::begin(detail::END_MARKER), std::end(detail::END_MARKER));
+        flush(0);
+    }
+};
+
+// reads rows on demand, decoding only the pixels of the next row
+class Reader {
+    FILE *file;
+    std::vector<uint8_t> header_bytes;
+    bool valid = false;
+    uint32_t img_width = 0, img_height = 0;
+    int out_channels = 0;
+    std::array<detail::Pixel, 64> index = {};
+    detail::Pixel px = { 0, 0, 0, 0xFF };
+    int run = 0;
+    uint32_t rows_read = 0;
+
+    static uint32_t get32(const uint8_t *p)
+    {
+        return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+
+    // reads @n bytes into @p, returning false at the end of the file
+    bool next(uint8_t *p, std::size_t n) { return std::fread(p, 1, n, file) == n; }
+
+    bool read_pixel()
+    {
+        using namespace detail;
+        if (run > 0) {
+            run--;
+            return true;
+        }
+        uint8_t b[5];
+        if (!next(b, 1))
+            return false;
+        if (b[0] == OP_RGB) {
+            if (!next(b + 1, 3))
+                return false;
+            px = { b[1], b[2], b[3], px.a };
+        } else if (b[0] == OP_RGBA) {
+            if (!next(b + 1, 4))
+                return false;
+            px = { b[1], b[2], b[3], b[4] };
+        } else if ((b[0] & OP_MASK) == OP_INDEX) {
+            px = index[b[0]];
+        } else if ((b[0] & OP_MASK) == OP_DIFF) {
+            px.r += (b[0] >> 4 & 3) - 2;
+            px.g += (b[0] >> 2 & 3) - 2;
+            px.b += (b[0]      & 3) - 2;
+        } else if ((b[0] & OP_MASK) == OP_LUMA) {
+            if (!next(b + 1, 1))
+                return false;
+            int dg = (b[0] & 0x3F) - 32;
+            px.r += dg - 8 + (b[1] >> 4);
+            px.g += dg;
+            px.b += dg - 8 + (b[1] & 0xF);
+        } else {
+            run = b[0] & 0x3F;
+        }
+        index[hash(px)] = px;
+        return true;
+    }
+
+public:
+    // reads the header. if the file isn't a QOI image, ok() returns false
+    // and consumed() has the bytes read so far.
+    explicit Reader(FILE *file)
+        : file(file)
+    {
+        header_bytes.resize(14);
+        header_bytes.resize(std::fread(header_bytes.data(), 1, 14, file));
+        if (header_bytes.size() != 14 || std::memcmp(header_bytes.data(), "qoif", 4) != 0)
+            return;
+        img_width    = get32(&header_bytes[4]);
+        img_height   = get32(&header_bytes[8]);
+        out_channels = header_bytes[12];
+        valid = img_width != 0 && (out_channels == 3 || out_channels == 4);
+    }
+
+    bool ok() const { return valid; }
+    std::span<const uint8_t> consumed() const { return header_bytes; }
+    std::size_t width() const { return img_width; }
+    std::size_t height() const { return img_height; }
+    int channels() const { return out_channels; }
+
+    // @row must have room for width() * channels() bytes. returns false
+    // after the last row or on errors.
+    bool read_row(std::span<uint8_t> row)
+    {
+        if (!valid || rows_read == img_height)
+            return false;
+        auto out = row.begin();
+        for (std::size_t x = 0; x < img_width; x++) {
+            if (!read_pixel())
+                return false;
+            *out++ = px.r;
+            *out++ = px.g;
+            *out++ = px.b;
+            if (out_channels == 4)
+                *out++ = px.a;
+        }
+        rows_read++;
+        return true;
+    }
+};
+
+} // namespace qoi
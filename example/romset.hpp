@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// gathers the data of several ROM files into a single stream of bytes.
+// arcade boards often split their graphics across chips, each holding every
+// other byte or word, and some dumps have their bytes swapped or are in SMD
+// format. files are mapped in memory (so POSIX only) and bytes are gathered
+// only when read, so that large sets never get merged into a file or read
+// whole.
+namespace romset {
+
+struct Layout {
+    std::size_t interleave = 0;     // bytes taken from each file in turn; 0 puts the files one after the other
+    std::size_t swap = 0;           // reverses the bytes of every group of this many (2 or 4); 0 for none
+    bool smd = false;               // files are SMD dumps (a 512 byte header, then 16K blocks of odd and even bytes)
+};
+
+// parses a comma separated list of: byte, word (interleave 1 or 2 bytes),
+// interleave=N (N bytes, e.g. one chip for each pair of planes), swap,
+// swap32 (swap bytes in 16 or 32 bit words), smd.
+// e.g. "word,swap" for two chips with 16 bit words of the wrong endianness.
+inline std::optional<Layout> parse_layout(std::string_view str)
+{
+    const std::string_view INTERLEAVE = "interleave=";
+    Layout layout;
+    while (!str.empty()) {
+        auto comma = std::min(str.find(','), str.size());
+        auto item = str.substr(0, comma);
+        str.remove_prefix(std::min(comma + 1, str.size()));
+             if (item == "byte")   layout.interleave = 1;
+        else if (item == "word")   layout.interleave = 2;
+        else if (item == "swap")   layout.swap = 2;
+        else if (item == "swap32") layout.swap = 4;
+        else if (item == "smd")    layout.smd = true;
+        else if (item.starts_with(INTERLEAVE)) {
+            auto n = item.substr(INTERLEAVE.size());
+            auto res = std::from_chars(n.data(), n.data() + n.size(), layout.interleave);
+            if (res.ec != std::errc() || res.ptr != n.data() + n.size() || layout.interleave == 0)
+                return std::nullopt;
+        } else
+            return std::nullopt;
+    }
+    return layout;
+}
+
+namespace detail {
+    const std::size_t SMD_HEADER = 512;
+    const std::size_t SMD_BLOCK  = 16384;
+
+    // a read only view of a whole file
+    class Mapping {
+        const uint8_t *ptr = nullptr;
+        std::size_t len = 0;
+
+    public:
+        Mapping() = default;
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        Mapping(Mapping &&m) : ptr(std::exchange(m.ptr, nullptr)), len(std::exchange(m.len, 0)) { }
+        Mapping &operator=(Mapping &&m) { std::swap(ptr, m.ptr); std::swap(len, m.len); return *this; }
+
+        ~Mapping()
+        {
+            if (ptr)
+                munmap(const_cast<uint8_t *>(ptr), len);
+        }
+
+        // empty files are fine and map to nothing
+        bool open(std::string_view name)
+        {
+            int fd = ::open(std::string(name).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            bool ok = fstat(fd, &st) == 0;
+            if (ok && st.st_size > 0) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ok = p != MAP_FAILED;
+                if (ok) {
+                    ptr = static_cast<const uint8_t *>(p);
+                    len = st.st_size;
+                    // bytes are mostly read in order
+                    madvise(p, len, MADV_SEQUENTIAL);
+                }
+            }
+            ::close(fd);
+            return ok;
+        }
+
+        std::span<const uint8_t> data() const { return { ptr, len }; }
+    };
+} // namespace detail
+
+class Source {
+    std::vector<detail::Mapping> files;
+    std::vector<std::span<const uint8_t>> datas;    // each file without its SMD header
+    Layout layout;
+    std::size_t total = 0;
+
+    // byte @i of a file, after undoing SMD blocks: each block has the odd
+    // bytes first, then the even ones
+    uint8_t file_byte(std::size_t file, std::size_t i) const
+    {
+        if (!layout.smd)
+            return datas[file][i];
+        auto block = i / detail::SMD_BLOCK * detail::SMD_BLOCK, j = i % detail::SMD_BLOCK;
+        return datas[file][block + (j & 1 ? 0 : detail::SMD_BLOCK / 2) + j / 2];
+    }
+
+    // which file byte @i of the stream comes from, and where, along with how
+    // many bytes after it come from right after it in the same file
+    struct Location { std::size_t file, offset, run; };
+
+    Location locate(std::size_t i) const
+    {
+        if (layout.interleave == 0) {
+            std::size_t file = 0;
+            while (i >= datas[file].size())
+                i -= datas[file++].size();
+            return { file, i, datas[file].size() - i };
+        }
+        auto unit = layout.interleave, chunk = i / unit;
+        return { chunk % files.size(), chunk / files.size() * unit + i % unit, unit - i % unit };
+    }
+
+public:
+    // opens every file in @names. on failure returns std::nullopt and
+    // leaves a message in @error.
+    static std::optional<Source> open(std::span<const std::string_view> names, Layout layout, std::string &error)
+    {
+        Source src;
+        src.layout = layout;
+        if (names.empty()) {
+            error = "no files given";
+            return std::nullopt;
+        }
+        for (auto &name : names) {
+            detail::Mapping m;
+            if (!m.open(name)) {
+                error = "couldn't open file " + std::string(name) + ": " + std::strerror(errno);
+                return std::nullopt;
+            }
+            auto data = m.data();
+            if (layout.smd) {
+                if (data.size() % detail::SMD_BLOCK != detail::SMD_HEADER) {
+                    error = std::string(name) + " isn't an SMD dump (its size should be 512 + a multiple of 16K)";
+                    return std::nullopt;
+                }
+                data = data.subspan(detail::SMD_HEADER);
+            }
+            src.files.push_back(std::move(m));
+            src.datas.push_back(data);
+        }
+        if (layout.interleave != 0) {
+            // every chip of a set has the same size
+            for (std::size_t i = 1; i < names.size(); i++) {
+                if (src.datas[i].size() != src.datas[0].size()) {
+                    error = "interleaved files must all be the same size (" + std::string(names[i]) + " isn't)";
+                    return std::nullopt;
+                }
+            }
+            if (src.datas[0].size() % layout.interleave != 0) {
+                error = "file sizes must be a multiple of the interleave";
+                return std::nullopt;
+            }
+        }
+        for (auto d : src.datas)
+            src.total += d.size();
+        if (layout.swap != 0 && src.total % layout.swap != 0) {
+            error = "total size must be a multiple of the swap size";
+            return std::nullopt;
+        }
+        return src;
+    }
+
+    std::size_t size() const { return total; }
+
+    // copies bytes from @offset on into @out, returning how many were copied
+    std::size_t read(std::size_t offset, std::span<uint8_t> out) const
+    {
+        auto n = std::min(out.size(), total - std::min(offset, total));
+        for (std::size_t i = 0; i < n; ) {
+            // swapped bytes come from all over a group: these go one by one
+            if (layout.swap != 0) {
+                auto j = offset + i, group = j / layout.swap * layout.swap;
+                auto [file, pos, run] = locate(group + layout.swap - 1 - (j - group));
+                out[i++] = file_byte(file, pos);
+                continue;
+            }
+            auto [file, pos, run] = locate(offset + i);
+            run = std::min(run, n - i);
+            if (layout.smd) {
+                for (std::size_t k = 0; k < run; k++)
+                    out[i + k] = file_byte(file, pos + k);
+            } else
+                std::memcpy(&out[i], &datas[file][pos], run);
+            i += run;
+        }
+        return n;
+    }
+
+    // the files' data, if the stream is simply the files one after the other
+    // and they can be used in place
+    std::optional<std::vector<std::span<const uint8_t>>> direct() const
+    {
+        if (layout.swap != 0 || layout.smd || (layout.interleave != 0 && files.size() > 1))
+            return std::nullopt;
+        return datas;
+    }
+};
+
+} // namespace romset
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
+#include <optional>
+#include <charconv>
+
+// small helpers shared by the example programs
+
+// parses the whole of @str as a number of type T (unsigned types don't take a sign)
+template <typename T = int, typename TStr = std::string>
+std::optional<T> to_number(const TStr &str, unsigned base = 10)
+{
+    T value = 0;
+    auto res = std::from_chars(str.data(), str.data() + str.size(), value, base);
+    if (res.ec != std::errc() || res.ptr != str.data() + str.size())
+        return std::nullopt;
+    return value;
+}
+
+// reads what's left of @f, after @prefix (bytes that were already read)
+inline std::vector<uint8_t> read_all(FILE *f, std::span<const uint8_t> prefix = {})
+{
+    std::vector<uint8_t> file(prefix.begin(), prefix.end());
+    std::array<uint8_t, 4096> buf;
+    while (auto n = std::fread(buf.data(), 1, buf.size(), f))
+        file.insert(file.end(), buf.begin(), buf.begin() + n);
+    return file;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+// waits for files to change, through inotify (so Linux only).
+// files are watched through their directory: most editors save by writing a
+// new file and renaming it over the old one, which a watch on the file itself
+// would miss.
+namespace watch {
+
+class Watcher {
+    int fd;
+    std::unordered_map<int, std::string> dirs;  // watch descriptor -> directory
+    std::unordered_set<std::string> files;
+
+    static std::string normalize(const std::filesystem::path &p)
+    {
+        auto dir = p.parent_path().empty() ? std::filesystem::path(".") : p.parent_path();
+        return (dir / p.filename()).lexically_normal().string();
+    }
+
+    // adds the watched files of every event that's ready to @changed
+    void read_events(std::unordered_set<std::string> &changed)
+    {
+        alignas(inotify_event) char buf[4096];
+        auto n = ::read(fd, buf, sizeof(buf));
+        for (char *p = buf; n > 0 && p < buf + n; ) {
+            auto *ev = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(inotify_event) + ev->len;
+            auto it = dirs.find(ev->wd);
+            if (it == dirs.end() || ev->len == 0)
+                continue;
+            auto name = normalize(std::filesystem::path(it->second) / ev->name);
+            if (files.count(name))
+                changed.insert(name);
+        }
+    }
+
+public:
+    Watcher() : fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) { }
+
+    ~Watcher()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    Watcher(const Watcher &) = delete;
+    Watcher &operator=(const Watcher &) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    // the name changes are reported with, which is @path made canonical
+    static std::string name(const std::string &path) { return normalize(path); }
+
+    bool add(const std::string &path)
+    {
+        auto name = normalize(path);
+        auto parent = std::filesystem::path(name).parent_path();
+        auto dir = parent.empty() ? std::string(".") : parent.string();
+        // a directory watched twice gets the same descriptor back
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd < 0)
+            return false;
+        dirs[wd] = dir;
+        files.insert(name);
+        return true;
+    }
+
+    void clear()
+    {
+        for (auto &[wd, dir] : dirs)
+            inotify_rm_watch(fd, wd);
+        dirs.clear();
+        files.clear();
+    }
+
+    // blocks until some watched file changes, then keeps collecting changes
+    // until none arrives for @debounce_ms, so that a save that takes several
+    // writes (or saving many files at once) is reported only once.
+    std::vector<std::string> wait(int debounce_ms)
+    {
+        std::unordered_set<std::string> changed;
+        pollfd pfd = { fd, POLLIN, 0 };
+        while (changed.empty()) {
+            if (poll(&pfd, 1, -1) < 0)
+                return {};
+            read_events(changed);
+        }
+        while (poll(&pfd, 1, debounce_ms) > 0)
+            read_events(changed);
+        return std::vector<std::string>(changed.begin(), changed.end());
+    }
+};
+
+} // namespace watch
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <algorithm>
+#include "deflate.hpp"
+
+// reads members of zip archives straight from the archive: stored members
+// are copied and deflated ones are inflated a chunk at a time, so that a
+// member is never extracted whole. ZIP64 and encrypted archives aren't
+// supported.
+namespace zip {
+
+const std::size_t CHUNK_SIZE = 4096;
+
+struct Entry {
+    std::string name;
+    uint16_t flags;             // bit 0 is set for encrypted members
+    uint16_t method;            // 0 for stored, 8 for deflate
+    uint32_t crc;
+    uint32_t compressed_size;
+    uint32_t size;
+    uint32_t header_offset;     // where the member's local header is
+
+    bool encrypted() const { return flags & 1; }
+};
+
+namespace detail {
+    const uint32_t END_SIGNATURE    = 0x06054B50;
+    const uint32_t ENTRY_SIGNATURE  = 0x02014B50;
+    const uint32_t HEADER_SIGNATURE = 0x04034B50;
+    const std::size_t END_SIZE      = 22;
+    const std::size_t ENTRY_SIZE    = 46;
+    const std::size_t HEADER_SIZE   = 30;
+    const std::size_t MAX_COMMENT   = 65535;
+
+    inline uint32_t get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+    inline uint32_t get32(const uint8_t *p) { return get16(p) | get16(p + 2) << 16; }
+
+    inline bool read_at(FILE *f, long offset, std::span<uint8_t> buf)
+    {
+        return std::fseek(f, offset, SEEK_SET) == 0
+            && std::fread(buf.data(), 1, buf.size(), f) == buf.size();
+    }
+} // namespace detail
+
+// reads the central directory of the archive in @file, which must be
+// seekable. directories are left out. returns std::nullopt if @file isn't
+// a zip archive.
+inline std::optional<std::vector<Entry>> read_directory(FILE *file)
+{
+    using namespace detail;
+    if (std::fseek(file, 0, SEEK_END) != 0)
+        return std::nullopt;
+    long size = std::ftell(file);
+    if (size < long(END_SIZE))
+        return std::nullopt;
+
+    // the end record is last, followed only by a comment of up to 64K
+    std::vector<uint8_t> tail(std::min<long>(size, END_SIZE + MAX_COMMENT));
+    if (!read_at(file, size - tail.size(), tail))
+        return std::nullopt;
+    auto end = tail.end();
+    for (auto i = tail.size() - END_SIZE + 1; i-- > 0; ) {
+        if (get32(&tail[i]) == END_SIGNATURE) {
+            end = tail.begin() + i;
+            break;
+        }
+    }
+    if (end == tail.end())
+        return std::nullopt;
+    auto num_entries = get16(&end[10]);
+    auto dir_size    = get32(&end[12]);
+    auto dir_offset  = get32(&end[16]);
+    if (uint64_t(dir_offset) + dir_size > uint64_t(size))
+        return std::nullopt;
+    std::vector<uint8_t> dir(dir_size);
+    if (!read_at(file, dir_offset, dir))
+        return std::nullopt;
+
+    std::vector<Entry> entries;
+    std::size_t pos = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (pos + ENTRY_SIZE > dir.size() || get32(&dir[pos]) != ENTRY_SIGNATURE)
+            return std::nullopt;
+        const uint8_t *e = &dir[pos];
+        std::size_t name_len = get16(e + 28), extra_len = get16(e + 30), comment_len = get16(e + 32);
+        if (pos + ENTRY_SIZE + name_len > dir.size())
+            return std::nullopt;
+        Entry entry = {
+            .name            = std::string(e + ENTRY_SIZE, e + ENTRY_SIZE + name_len),
+            .flags           = uint16_t(get16(e + 8)),
+            .method          = uint16_t(get16(e + 10)),
+            .crc             = get32(e + 16),
+            .compressed_size = get32(e + 20),
+            .size            = get32(e + 24),
+            .header_offset   = get32(e + 42),
+        };
+        if (!entry.name.ends_with('/'))
+            entries.push_back(std::move(entry));
+        pos += ENTRY_SIZE + name_len + extra_len + comment_len;
+    }
+    return entries;
+}
+
+// passes the contents of @entry to @output, CHUNK_SIZE bytes at a time.
+// returns false if the member is corrupt, encrypted or uses an unsupported
+// method; chunks already passed to @output aren't taken back.
+inline bool read_entry(FILE *file, const Entry &entry, std::function<void(std::span<const uint8_t>)> output)
+{
+    using namespace detail;
+    std::array<uint8_t, HEADER_SIZE> header;
+    if (!read_at(file, entry.header_offset, header) || get32(&header[0]) != HEADER_SIGNATURE
+     || entry.encrypted() || (get16(&header[6]) & 1))
+        return false;
+    // the name and extra field may differ from the ones in the directory
+    long data = entry.header_offset + HEADER_SIZE + get16(&header[26]) + get16(&header[28]);
+    if (std::fseek(file, data, SEEK_SET) != 0)
+        return false;
+
+    std::size_t left = entry.compressed_size, total = 0;
+    auto input = [&](std::span<uint8_t> buf) {
+        auto n = std::fread(buf.data(), 1, std::min(buf.size(), left), file);
+        left -= n;
+        return n;
+    };
+    uint32_t crc = 0;
+    std::array<uint8_t, CHUNK_SIZE> buf;
+    auto emit = [&](std::size_t n) {
+        auto chunk = std::span(buf).first(n);
+        crc = deflate::crc32(crc, chunk);
+        total += n;
+        output(chunk);
+    };
+
+    if (entry.method == 0) {
+        while (auto n = input(buf))
+            emit(n);
+    } else if (entry.method == 8) {
+        deflate::Decompressor inflater(input, false);
+        for (std::size_t n; (n = inflater.read(buf)) > 0 && total + n <= entry.size; )
+            emit(n);
+        if (!inflater.done())
+            return false;
+    } else
+        return false;
+    return total == entry.size && crc == entry.crc;
+}
+
+} // namespace zip
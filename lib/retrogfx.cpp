@@ -1,11 +1,19 @@
 #include "retrogfx.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cstdio>
 #include <cmath>
 #include <cstring>
 #include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 using u8  = uint8_t;
 using u32 = uint32_t;
@@ -43,7 +51,7 @@ namespace {
 
 
 namespace decoders {
-    int planar(std::span<u8> tile, int y, int x, int bpp)
+    int planar(std::span<const u8> tile, int y, int x, int bpp)
     {
         u8 nbit = 7 - x;
         u8 res = 0;
@@ -52,7 +60,7 @@ namespace decoders {
         return res;
     }
 
-    int interwined(std::span<u8> tile, int y, int x, int bpp)
+    int interwined(std::span<const u8> tile, int y, int x, int bpp)
     {
         u8 nbit = 7 - x;
         u8 res = 0;
@@ -67,65 +75,393 @@ namespace decoders {
         return res;
     }
 
-    int gba(std::span<u8> tile, int y, int x, int bpp)
+    int gba(std::span<const u8> tile, int y, int x, int bpp)
     {
         assert((bpp == 4 || bpp == 8)
-            && "GBA format can't use BPP values that aren't 4 or 8");
+            && "GBA, PS1 and N64 formats can't use BPP values that aren't 4 or 8");
         u8 version = getbit(bpp, 2); // 1 for 4, 0 for 8
         return getbits(tile[y * bpp + (x >> version)],
                        (x & version) << 2, bpp);
     }
+
+    int virtual_boy(std::span<const u8> tile, int y, int x, int bpp)
+    {
+        assert(bpp == 2 && "Virtual Boy format can only use 2 BPP");
+        return getbits(tile[y*2 + x/4], x%4 * 2, 2);
+    }
+
+    int ngp(std::span<const u8> tile, int y, int x, int bpp)
+    {
+        assert(bpp == 2 && "NGP format can only use 2 BPP");
+        return getbits(tile[y*2 + 1 - x/4], (3 - x%4) * 2, 2);
+    }
 } // namespace decoders
 
-int decode_pixel(std::span<u8> tile, int row, int col, int bpp, Format mode)
+// GBA, PS1 and N64 pixels are packed one (8 bpp) or two (4 bpp) per byte,
+// row after row, so whole rows can be converted at once.
+namespace packed {
+    // whether the pixel on the left is in the high nibble, on 4 bpp
+    bool high_first(Format format)
+    {
+        return format == Format::N64;
+    }
+
+    // whether the format has no tiles at all, just rows of pixels
+    bool is_linear(Format format)
+    {
+        return format == Format::PS1 || format == Format::N64;
+    }
+
+    bool is_packed(Format format)
+    {
+        return format == Format::GBA || is_linear(format);
+    }
+
+    inline uint64_t swap_nibbles(uint64_t x)
+    {
+        return (x & 0x0F0F0F0F0F0F0F0F) << 4 | (x >> 4 & 0x0F0F0F0F0F0F0F0F);
+    }
+
+    // both functions work on 8 indexes (one 64-bit word) at a time: each
+    // step halves (or doubles) the distance between neighbouring nibbles.
+    // This relies on little endian loads, so big endian hosts take the slow
+    // path. @count is the number of pixels, and can be odd.
+    void pack(const u8 *indices, u8 *out, std::size_t count, bool high_first)
+    {
+        std::size_t i = 0;
+        if constexpr (std::endian::native == std::endian::little) {
+            for ( ; i + 8 <= count; i += 8) {
+                uint64_t x;
+                std::memcpy(&x, &indices[i], 8);
+                x &= 0x0F0F0F0F0F0F0F0F;
+                x = (x | x >>  4) & 0x00FF00FF00FF00FF;
+                x = (x | x >>  8) & 0x0000FFFF0000FFFF;
+                x = (x | x >> 16) & 0x00000000FFFFFFFF;
+                if (high_first)
+                    x = swap_nibbles(x);
+                uint32_t w = x;
+                std::memcpy(&out[i/2], &w, 4);
+            }
+        }
+        for ( ; i < count; i += 2) {
+            u8 left = indices[i] & 0xF, right = i + 1 < count ? indices[i+1] & 0xF : 0;
+            out[i/2] = high_first ? left << 4 | right : right << 4 | left;
+        }
+    }
+
+    void unpack(const u8 *in, u8 *indices, std::size_t count, bool high_first)
+    {
+        std::size_t i = 0;
+        if constexpr (std::endian::native == std::endian::little) {
+            for ( ; i + 8 <= count; i += 8) {
+                uint32_t w;
+                std::memcpy(&w, &in[i/2], 4);
+                uint64_t x = high_first ? swap_nibbles(w) : w;
+                x = (x | x << 16) & 0x0000FFFF0000FFFF;
+                x = (x | x <<  8) & 0x00FF00FF00FF00FF;
+                x = (x | x <<  4) & 0x0F0F0F0F0F0F0F0F;
+                std::memcpy(&indices[i], &x, 8);
+            }
+        }
+        for ( ; i < count; i++) {
+            bool high = (i & 1) != high_first;
+            indices[i] = high ? in[i/2] >> 4 : in[i/2] & 0xF;
+        }
+    }
+
+    void pack_row(const u8 *indices, u8 *out, std::size_t width, int bpp, bool high_first)
+    {
+        if (bpp == 8)
+            std::memcpy(out, indices, width);
+        else
+            pack(indices, out, width, high_first);
+    }
+
+    void unpack_row(const u8 *in, u8 *indices, std::size_t width, int bpp, bool high_first)
+    {
+        if (bpp == 8)
+            std::memcpy(indices, in, width);
+        else
+            unpack(in, indices, width, high_first);
+    }
+} // namespace packed
+
+// Virtual Boy and NGP rows are little endian 16-bit words with 2 bits per
+// pixel, so a row spreads out to 8 bytes (and back) with a few shifts.
+namespace words {
+    bool is_word(Format format)
+    {
+        return format == Format::VirtualBoy || format == Format::NGP;
+    }
+
+    inline uint64_t bswap64(uint64_t x)
+    {
+        x = (x & 0x00000000FFFFFFFF) << 32 | x >> 32;
+        x = (x & 0x0000FFFF0000FFFF) << 16 | (x >> 16 & 0x0000FFFF0000FFFF);
+        x = (x & 0x00FF00FF00FF00FF) <<  8 | (x >>  8 & 0x00FF00FF00FF00FF);
+        return x;
+    }
+
+    // pixel i goes from bits 2i-2i+1 to byte i
+    inline uint64_t spread(uint64_t x)
+    {
+        x = (x | x << 24) & 0x000000FF000000FF;
+        x = (x | x << 12) & 0x000F000F000F000F;
+        x = (x | x <<  6) & 0x0303030303030303;
+        return x;
+    }
+
+    inline uint64_t gather(uint64_t x)
+    {
+        x &= 0x0303030303030303;
+        x = (x | x >>  6) & 0x000F000F000F000F;
+        x = (x | x >> 12) & 0x000000FF000000FF;
+        x = (x | x >> 24) & 0x000000000000FFFF;
+        return x;
+    }
+
+    // the NGP stores the leftmost pixel in the highest bits instead, which
+    // simply reverses the order of the bytes once spread out
+    void unpack_tile(const u8 *tile, u8 *out, Format format)
+    {
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            uint64_t x = spread(tile[y*2] | tile[y*2+1] << 8);
+            if (format == Format::NGP)
+                x = bswap64(x);
+            for (int i = 0; i < TILE_WIDTH; i++)
+                out[y*TILE_WIDTH + i] = x >> i*8;
+        }
+    }
+
+    void pack_tile(const u8 *indices, u8 *tile, Format format)
+    {
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            uint64_t x = 0;
+            for (int i = 0; i < TILE_WIDTH; i++)
+                x |= uint64_t(indices[y*TILE_WIDTH + i]) << i*8;
+            if (format == Format::NGP)
+                x = bswap64(x);
+            x = gather(x);
+            tile[y*2]   = x;
+            tile[y*2+1] = x >> 8;
+        }
+    }
+} // namespace words
+
+int decode_pixel(std::span<const u8> tile, int row, int col, int bpp, Format mode)
 {
     switch (mode) {
     case Format::Planar:     return decoders::planar(tile, row, col, bpp);
     case Format::Interwined: return decoders::interwined(tile, row, col, bpp);
-    case Format::GBA:        return decoders::gba(tile, row, col, bpp);
+    case Format::GBA:
+    case Format::PS1:        return decoders::gba(tile, row, col, bpp);
+    // flipping the low bit of the column swaps the nibbles on 4 bpp
+    case Format::N64:        return decoders::gba(tile, row, col ^ (bpp == 4), bpp);
+    case Format::VirtualBoy: return decoders::virtual_boy(tile, row, col, bpp);
+    case Format::NGP:        return decoders::ngp(tile, row, col, bpp);
     default:                 return 0;
     }
 }
 
-// when converting tiles, they are converted row-wise, i.e. first we convert
-// the first row of every single tile, then the second, etc...
-// decode_pixel()'s job is to do the conversion for one single tile
-std::array<int, ROW_SIZE> decode_row(std::span<u8> tiles, int y, int num_tiles,
-                                    int bpp, Format mode)
+namespace {
+    // byte offset of bit-plane @plane for row @y inside a Planar or
+    // Interwined tile. on Interwined, planes are stored in pairs, with a
+    // lone plane at the end when bpp is odd.
+    int plane_offset(Format format, int bpp, int plane, int y)
+    {
+        if (format == Format::Planar)
+            return y + plane*8;
+        if (bpp % 2 != 0 && plane == bpp - 1)
+            return plane/2*16 + y;
+        return plane/2*16 + y*2 + plane%2;
+    }
+
+    bool is_planar(Format format)
+    {
+        return format == Format::Planar || format == Format::Interwined;
+    }
+}
+
+// Planar and Interwined rows are one byte per plane, so a row of 8 pixels is
+// put together a plane at a time, spreading the 8 bits of each plane byte
+// over 8 bytes. There's more than one way to do that, and which one is
+// fastest depends on the machine: autotune() picks one.
+namespace planar_rows {
+    // byte i holds bit 7-i of the index
+    const std::array<uint64_t, 256> spread_table = [] {
+        std::array<uint64_t, 256> t;
+        for (int b = 0; b < 256; b++) {
+            t[b] = 0;
+            for (int i = 0; i < 8; i++)
+                t[b] |= uint64_t(getbit(b, 7 - i)) << i*8;
+        }
+        return t;
+    }();
+
+    // the multiplication puts a copy of @b in every byte, the mask keeps bit
+    // 7-i in byte i, and the addition carries any set bit up to bit 7
+    inline uint64_t spread_swar(u8 b)
+    {
+        uint64_t x = (uint64_t(b) * 0x0101010101010101) & 0x0102040810204080;
+        return (x + 0x7F7F7F7F7F7F7F7F) >> 7 & 0x0101010101010101;
+    }
+
+    inline uint64_t spread_lut(u8 b) { return spread_table[b]; }
+
+    void bits(const u8 *tile, int bpp, Format format, int y, u8 *out)
+    {
+        for (int x = 0; x < TILE_WIDTH; x++)
+            out[x] = decode_pixel(std::span(tile, bpp*8), y, x, bpp, format);
+    }
+
+    template <uint64_t (*Spread)(u8)>
+    void spread(const u8 *tile, int bpp, Format format, int y, u8 *out)
+    {
+        uint64_t x = 0;
+        for (int p = 0; p < bpp; p++)
+            x |= Spread(tile[plane_offset(format, bpp, p, y)]) << p;
+        for (int i = 0; i < TILE_WIDTH; i++)
+            out[i] = x >> i*8;
+    }
+
+    using Kernel = void (*)(const u8 *, int, Format, int, u8 *);
+
+    Kernel get(RowKernel k)
+    {
+        switch (k) {
+        case RowKernel::Bits:  return bits;
+        case RowKernel::Table: return spread<spread_lut>;
+        default:               return spread<spread_swar>;
+        }
+    }
+} // namespace planar_rows
+
+namespace {
+    // what decoding uses right now; see autotune()
+    std::atomic<RowKernel> row_kernel = RowKernel::SWAR;
+    std::atomic<std::size_t> band_rows = 16;
+    std::atomic<unsigned> num_threads = 0;
+    std::atomic<std::size_t> parallel_rows = 64;
+}
+
+// decodes one whole tile into @out, row after row.
+// decode_pixel()'s job is to do the conversion for one single pixel
+void decode_tile(std::span<const u8> tile, int bpp, Format mode, u8 *out)
 {
-    int bpt = bpp*8;
-    std::array<int, ROW_SIZE> res;
-    // n = tile number; x = tile column
-    for (int n = 0; n < TILES_PER_ROW; n++) {
-        std::span<u8> tile = tiles.subspan(n*bpt, bpt);
-        for (int x = 0; x < 8; x++)
-            res[n*8 + x] = n < num_tiles ? decode_pixel(tile, y, x, bpp, mode) : 0;
+    if (packed::is_packed(mode)) {
+        assert(format_supports_bpp(mode, bpp) && "GBA, PS1 and N64 formats can only use 4 or 8 BPP");
+        packed::unpack_row(tile.data(), out, TILE_WIDTH * TILE_HEIGHT, bpp, packed::high_first(mode));
+        return;
     }
-    return res;
+    if (words::is_word(mode)) {
+        assert(bpp == 2 && "Virtual Boy and NGP formats can only use 2 BPP");
+        words::unpack_tile(tile.data(), out, mode);
+        return;
+    }
+    if (is_planar(mode)) {
+        auto kernel = planar_rows::get(row_kernel.load(std::memory_order_relaxed));
+        for (int y = 0; y < TILE_HEIGHT; y++)
+            kernel(tile.data(), bpp, mode, y, &out[y*TILE_WIDTH]);
+        return;
+    }
+    for (int y = 0; y < TILE_HEIGHT; y++)
+        for (int x = 0; x < TILE_WIDTH; x++)
+            out[y*TILE_WIDTH + x] = decode_pixel(tile, y, x, bpp, mode);
 }
 
-void decode(std::span<uint8_t> bytes, int bpp, Format mode,
-            std::function<void(std::span<int>)> draw_row)
-{
-    // this loop inspect at most 16 tiles each iteration
-    // the inner loop gets one single row of pixels and draws it
-    int bpt = bpp*8;
-    for (std::size_t i = 0; i < bytes.size(); i += bpt * TILES_PER_ROW) {
-        // calculate how many tiles we can get. can be at most TILES_PER_ROW
-        // this is necessary in case we are at the end and the number of tiles
-        // is not a multiple of TILES_PER_ROW.
+namespace {
+    // decodes one row of at most 16 tiles. this is necessary in case we are
+    // at the end and the number of tiles is not a multiple of TILES_PER_ROW:
+    // missing tiles are left blank.
+    // tiles are decoded one after the other, then deswizzled into rows of
+    // pixels, and each row of pixels is drawn
+    void decode_band(std::span<const u8> tiles, int bpp, Format mode,
+                     const std::function<void(std::span<int>)> &draw_row)
+    {
+        std::size_t bpt = bpp*8;
         // division by bpt (bytes per tile) to go from bytes -> tiles
-        std::size_t count     = std::min(bytes.size() - i,
-                                         (std::size_t) bpt * TILES_PER_ROW);
-        std::size_t num_tiles = count / bpt;
-        std::span<u8> tiles   = bytes.subspan(i, count);
+        std::size_t num_tiles = tiles.size() / bpt;
+        std::array<u8, ROW_SIZE * TILE_HEIGHT> decoded, band;
+        std::array<int, ROW_SIZE> row;
+        if (packed::is_linear(mode)) {
+            assert(format_supports_bpp(mode, bpp) && "GBA, PS1 and N64 formats can only use 4 or 8 BPP");
+            // no tiles here, just 8 rows of pixels
+            std::array<u8, MAX_BPP * ROW_SIZE> bytes = {};
+            std::copy(tiles.begin(), tiles.end(), bytes.begin());
+            packed::unpack_row(bytes.data(), band.data(), ROW_SIZE * TILE_HEIGHT, bpp, packed::high_first(mode));
+            for (int r = 0; r < TILE_HEIGHT; r++) {
+                std::copy(&band[r * ROW_SIZE], &band[(r+1) * ROW_SIZE], row.begin());
+                draw_row(row);
+            }
+            return;
+        }
+        for (std::size_t n = 0; n < TILES_PER_ROW; n++) {
+            auto out = &decoded[n * TILE_WIDTH * TILE_HEIGHT];
+            if (n < num_tiles)
+                decode_tile(tiles.subspan(n*bpt, bpt), bpp, mode, out);
+            else
+                std::fill(out, out + TILE_WIDTH * TILE_HEIGHT, 0);
+        }
+        deswizzle(decoded, band, ROW_SIZE, TILE_HEIGHT, ROW_SIZE);
         for (int r = 0; r < TILE_HEIGHT; r++) {
-            auto row = decode_row(tiles, r, num_tiles, bpp, mode);
+            std::copy(&band[r * ROW_SIZE], &band[(r+1) * ROW_SIZE], row.begin());
             draw_row(row);
         }
     }
 }
 
+void decode(std::span<uint8_t> bytes, int bpp, Format mode,
+            std::function<void(std::span<int>)> draw_row, unsigned max_threads)
+{
+    Decoder decoder(bpp, mode, draw_row, max_threads);
+    decoder.push(bytes);
+    decoder.finish();
+}
+
+Decoder::Decoder(int bpp, Format format, std::function<void(std::span<int>)> draw_row, unsigned max_threads)
+    : bpp(bpp), format(format), draw_row(draw_row), max_threads(max_threads)
+{ }
+
+void Decoder::push(std::span<const uint8_t> bytes)
+{
+    std::size_t band_size = bpp*8 * TILES_PER_ROW;
+    // complete the row of tiles left over by the last push first
+    if (!pending.empty()) {
+        auto n = std::min(band_size - pending.size(), bytes.size());
+        pending.insert(pending.end(), bytes.begin(), bytes.begin() + n);
+        bytes = bytes.subspan(n);
+        if (pending.size() < band_size)
+            return;
+        decode_band(pending, bpp, format, draw_row);
+        pending.clear();
+    }
+    // many rows of tiles at once go through decode_image(), a batch at a
+    // time so that only a batch of decoded rows is ever kept around
+    std::size_t full = bytes.size() / band_size, min_rows = parallel_rows;
+    if (full >= min_rows) {
+        std::size_t batch = std::max<std::size_t>(min_rows, band_rows * std::max(std::thread::hardware_concurrency(), 1u) * 4);
+        std::vector<u8> image(std::min(batch, full) * ROW_SIZE * TILE_HEIGHT);
+        std::array<int, ROW_SIZE> row;
+        for (std::size_t n; (n = std::min(batch, bytes.size() / band_size)) > 0; bytes = bytes.subspan(n * band_size)) {
+            auto decoded = std::span(image).first(n * ROW_SIZE * TILE_HEIGHT);
+            decode_image(bytes.first(n * band_size), bpp, format, decoded, max_threads);
+            for (std::size_t i = 0; i < decoded.size(); i += ROW_SIZE) {
+                std::copy(&decoded[i], &decoded[i + ROW_SIZE], row.begin());
+                draw_row(row);
+            }
+        }
+    }
+    for ( ; bytes.size() >= band_size; bytes = bytes.subspan(band_size))
+        decode_band(bytes.first(band_size), bpp, format, draw_row);
+    pending.assign(bytes.begin(), bytes.end());
+}
+
+void Decoder::finish()
+{
+    if (!pending.empty())
+        decode_band(pending, bpp, format, draw_row);
+    pending.clear();
+}
 
 
 namespace encoders {
@@ -160,16 +496,6 @@ namespace encoders {
             res[i*16 + y] = bytes[i*2];
         }
     }
-
-    void gba(std::span<u8> res, std::span<u8> row, int bpp, int y)
-    {
-        u8 version = getbit(bpp, 2); // 1 for 4, 0 for 8
-        for (int x = 0; x < TILE_WIDTH; x++) {
-            // res[y * 4 + (x >> version)] |= (row[x] << ((x & version) << 2));
-            int i = y * 4 + (x >> version);
-            res[i] = setbits(res[i], (x & version) << 2, 8 >> version, row[x]);
-        }
-    }
 } // namespace encoders
 
 // std::array<u8, MAX_BPP*TILE_HEIGHT> encode_tile(Span2D<u8> tile, int bpp, Format format)
@@ -203,15 +529,24 @@ namespace encoders {
 //     }
 // }
 
-std::array<u8, MAX_BPP*TILE_HEIGHT> encode_tile(std::span<u8> indices, std::size_t index, std::size_t stride, int bpp, Format format)
+std::array<u8, MAX_BPP*TILE_HEIGHT> encode_tile(std::span<u8> tile, int bpp, Format format)
 {
     std::array<u8, MAX_BPP*TILE_HEIGHT> res = {};
+    if (packed::is_packed(format)) {
+        assert(format_supports_bpp(format, bpp) && "GBA, PS1 and N64 formats can only use 4 or 8 BPP");
+        packed::pack_row(tile.data(), res.data(), TILE_WIDTH * TILE_HEIGHT, bpp, packed::high_first(format));
+        return res;
+    }
+    if (words::is_word(format)) {
+        assert(bpp == 2 && "Virtual Boy and NGP formats can only use 2 BPP");
+        words::pack_tile(tile.data(), res.data(), format);
+        return res;
+    }
     for (auto y = 0u; y < TILE_HEIGHT; y++) {
-        auto row = indices.subspan(index + y * (stride + 8), 8);
+        auto row = tile.subspan(y * TILE_WIDTH, TILE_WIDTH);
         switch (format) {
         case Format::Planar:     encoders::planar(    res, row, bpp, y); break;
         case Format::Interwined: encoders::interwined(res, row, bpp, y); break;
-        case Format::GBA:        encoders::gba(       res, row, bpp, y); break;
         default: break;
         }
     }
@@ -224,14 +559,2605 @@ void encode(std::span<u8> indices, std::size_t width, std::size_t height, int bp
         std::fprintf(stderr, "error: width and height must be a power of 8");
         return;
     }
-    auto stride = width - 8;
-    for (auto y = 0u; y < height; y += 8) {
-        for (auto x = 0u; x < width; x += 8) {
-            auto encoded = encode_tile(indices, y * width + x, stride, bpp, format);
-            std::span<u8> tilespan{encoded.begin(), encoded.begin() + bpp*8};
-            write_data(tilespan);
+    Encoder encoder(width, bpp, format, write_data);
+    for (auto y = 0u; y < height; y++)
+        encoder.push_row(indices.subspan(y * width, width));
+    encoder.finish();
+}
+
+Encoder::Encoder(std::size_t width, int bpp, Format format,
+                 std::function<void(std::span<uint8_t>)> write_data)
+    : width(width), bpp(bpp), format(format), write_data(write_data),
+      rows(width * TILE_HEIGHT), band(width * TILE_HEIGHT)
+{
+    assert(width % TILE_WIDTH == 0 && "width must be a multiple of 8");
+}
+
+void Encoder::push_row(std::span<const uint8_t> row)
+{
+    assert(row.size() >= width && "row too short");
+    std::copy(row.begin(), row.begin() + width, rows.begin() + num_rows * width);
+    if (++num_rows == TILE_HEIGHT)
+        encode_band();
+}
+
+void Encoder::finish()
+{
+    if (num_rows == 0)
+        return;
+    std::fill(rows.begin() + num_rows * width, rows.end(), 0);
+    encode_band();
+}
+
+// swizzle a band of 8 rows at a time, so that each tile's pixels are
+// contiguous when encoding
+void Encoder::encode_band()
+{
+    if (packed::is_linear(format)) {
+        assert(format_supports_bpp(format, bpp) && "GBA, PS1 and N64 formats can only use 4 or 8 BPP");
+        std::size_t row_size = width * bpp / 8;
+        for (std::size_t r = 0; r < TILE_HEIGHT; r++) {
+            packed::pack_row(&rows[r * width], band.data(), width, bpp, packed::high_first(format));
+            write_data(std::span(band).first(row_size));
+        }
+        num_rows = 0;
+        return;
+    }
+    swizzle(rows, band, width, TILE_HEIGHT, width);
+    for (auto x = 0u; x < width; x += 8) {
+        auto encoded = encode_tile(std::span(band).subspan(x * TILE_HEIGHT, TILE_WIDTH * TILE_HEIGHT), bpp, format);
+        std::span<u8> tilespan{encoded.begin(), encoded.begin() + bpp*8};
+        write_data(tilespan);
+    }
+    num_rows = 0;
+}
+
+// tiles in streams of bits are moved 64 bits at a time: each word is put
+// together from the two big endian words it straddles with a funnel shift.
+// a tile being bpp*64 bits long, it's always a whole number of words
+namespace bitstream {
+    // compilers turn these loops into a single (byte swapped) load or store
+    uint64_t load64(const u8 *p)
+    {
+        uint64_t x = 0;
+        for (int i = 0; i < 8; i++)
+            x = x << 8 | p[i];
+        return x;
+    }
+
+    void store64(u8 *p, uint64_t x)
+    {
+        for (int i = 7; i >= 0; i--, x >>= 8)
+            p[i] = x & 0xFF;
+    }
+
+    // the 64 bits at bit @pos of @bytes
+    uint64_t read(std::span<const u8> bytes, std::size_t pos)
+    {
+        auto i = pos / 8, shift = pos % 8;
+        // close to the end, bytes past it count as 0
+        if (i + 16 > bytes.size()) {
+            std::array<u8, 16> buf = {};
+            std::copy(bytes.begin() + i, bytes.begin() + std::min(i + 16, bytes.size()), buf.begin());
+            auto hi = load64(&buf[0]), lo = load64(&buf[8]);
+            return shift == 0 ? hi : hi << shift | lo >> (64 - shift);
+        }
+        auto hi = load64(&bytes[i]), lo = load64(&bytes[i + 8]);
+        return shift == 0 ? hi : hi << shift | lo >> (64 - shift);
+    }
+
+    // writes @x at bit @pos of @bytes, leaving the bits around it alone
+    void write(std::span<u8> bytes, std::size_t pos, uint64_t x)
+    {
+        auto i = pos / 8, shift = pos % 8;
+        if (shift == 0) {
+            store64(&bytes[i], x);
+            return;
+        }
+        uint64_t keep = ~uint64_t(0) << (64 - shift);
+        store64(&bytes[i], (load64(&bytes[i]) & keep) | x >> shift);
+        bytes[i + 8] = (bytes[i + 8] & (0xFF >> shift)) | u8(x << (8 - shift));
+    }
+} // namespace bitstream
+
+void gather_bits(std::span<const uint8_t> bytes, std::size_t bit_offset, std::size_t bit_stride, int bpp,
+                 std::function<void(std::span<const uint8_t>)> output)
+{
+    std::size_t tile_bits = bpp*64, total_bits = bytes.size() * 8;
+    assert(bit_stride >= tile_bits && "tiles can't overlap");
+    // tiles are gathered a row of tiles at a time
+    std::array<u8, MAX_BPP*8 * TILES_PER_ROW> buf;
+    std::size_t n = 0;
+    for (auto pos = bit_offset; pos + tile_bits <= total_bits && pos >= bit_offset; pos += bit_stride) {
+        for (int w = 0; w < bpp; w++)
+            bitstream::store64(&buf[n + w*8], bitstream::read(bytes, pos + w*64));
+        n += bpp*8;
+        if (n == buf.size() / MAX_BPP * bpp) {
+            output(std::span(buf).first(n));
+            n = 0;
+        }
+    }
+    if (n != 0)
+        output(std::span(buf).first(n));
+}
+
+void decode_bits(std::span<const uint8_t> bytes, std::size_t bit_offset, std::size_t bit_stride, int bpp,
+                 Format format, std::function<void(std::span<int>)> draw_row)
+{
+    Decoder decoder(bpp, format, draw_row);
+    gather_bits(bytes, bit_offset, bit_stride, bpp, [&](std::span<const u8> tiles) { decoder.push(tiles); });
+    decoder.finish();
+}
+
+std::size_t encode_bits(std::span<const uint8_t> indices, std::size_t width, std::size_t height, int bpp,
+                        Format format, std::span<uint8_t> bytes, std::size_t bit_offset, std::size_t bit_stride)
+{
+    std::size_t tile_bits = bpp*64, total_bits = bytes.size() * 8, num_tiles = 0;
+    assert(bit_stride >= tile_bits && "tiles can't overlap");
+    // linear formats give out rows that aren't whole tiles, so these are
+    // put back together first
+    std::vector<u8> pending;
+    auto pos = bit_offset;
+    Encoder encoder(width, bpp, format, [&](std::span<const u8> data) {
+        pending.insert(pending.end(), data.begin(), data.end());
+        std::size_t i = 0;
+        for ( ; i + bpp*8 <= pending.size(); i += bpp*8, pos += bit_stride) {
+            if (pos + tile_bits > total_bits || pos < bit_offset)
+                continue;
+            for (int w = 0; w < bpp; w++)
+                bitstream::write(bytes, pos + w*64, bitstream::load64(&pending[i + w*8]));
+            num_tiles++;
+        }
+        pending.erase(pending.begin(), pending.begin() + i);
+    });
+    for (std::size_t y = 0; y < height; y++)
+        encoder.push_row(indices.subspan(y * width, width));
+    encoder.finish();
+    return num_tiles;
+}
+
+JobPool::JobPool(std::size_t num_threads, std::size_t max_pending)
+    : max_pending(max_pending)
+{
+    if (num_threads == 0)
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (std::size_t i = 0; i < num_threads; i++)
+        workers.emplace_back([this] { work(); });
+}
+
+JobPool::~JobPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+std::size_t JobPool::pending() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return num_pending;
+}
+
+bool JobPool::push(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping || num_pending >= max_pending)
+            return false;
+        num_pending++;
+        queue.push_back(std::move(job));
+    }
+    wake.notify_one();
+    return true;
+}
+
+void JobPool::work()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || !queue.empty(); });
+            // when stopping, the queue still gets emptied first
+            if (queue.empty())
+                return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        // a job counts as pending until its completion has been delivered
+        job();
+        std::lock_guard<std::mutex> guard(lock);
+        num_pending--;
+    }
+}
+
+namespace {
+    std::string check_format(int bpp, Format format)
+    {
+        if (!format_to_string(format))
+            return "invalid format";
+        if (!format_supports_bpp(format, bpp))
+            return "format " + std::string(format_to_string(format).value()) + " can't use "
+                 + std::to_string(bpp) + " bpp";
+        return "";
+    }
+
+    // runs @job, turning what it throws (e.g. std::bad_alloc on huge
+    // requests) into a failed result, so that the worker thread survives
+    JobResult run_job(auto &&job)
+    {
+        JobResult res;
+        try {
+            job(res);
+            res.ok = true;
+        } catch (const std::exception &e) {
+            res = JobResult();
+            res.error = e.what();
+        }
+        return res;
+    }
+
+    JobResult failed_job(std::string error)
+    {
+        JobResult res;
+        res.error = std::move(error);
+        return res;
+    }
+}
+
+bool JobPool::submit_decode(std::vector<uint8_t> bytes, int bpp, Format format, Callback done)
+{
+    // invalid jobs still go through the queue, so that @done is always
+    // called on a worker, never before this returns
+    if (auto error = check_format(bpp, format); !error.empty())
+        return push([error, done = std::move(done)] { done(failed_job(error)); });
+    return push([bytes = std::move(bytes), bpp, format, done = std::move(done)]() mutable {
+        done(run_job([&](JobResult &res) {
+            res.width  = ROW_SIZE;
+            res.height = img_height(bytes.size(), bpp);
+            res.data.reserve(res.width * res.height);
+            // the pool's workers already keep every core busy
+            decode(bytes, bpp, format, [&](std::span<int> row) {
+                res.data.insert(res.data.end(), row.begin(), row.end());
+            }, 1);
+        }));
+    });
+}
+
+bool JobPool::submit_encode(std::vector<uint8_t> indices, std::size_t width, std::size_t height,
+                            int bpp, Format format, Callback done)
+{
+    auto error = check_format(bpp, format);
+    if (error.empty() && (width == 0 || width % TILE_WIDTH != 0 || height % TILE_HEIGHT != 0))
+        error = "width and height must be multiples of 8";
+    else if (error.empty() && height > indices.size() / width)
+        error = "indices must be width * height bytes";
+    if (!error.empty())
+        return push([error, done = std::move(done)] { done(failed_job(error)); });
+    return push([indices = std::move(indices), width, height, bpp, format, done = std::move(done)]() mutable {
+        done(run_job([&](JobResult &res) {
+            res.width  = width;
+            res.height = height;
+            encode(indices, width, height, bpp, format, [&](std::span<uint8_t> tile) {
+                res.data.insert(res.data.end(), tile.begin(), tile.end());
+            });
+        }));
+    });
+}
+
+namespace {
+    // the promise is shared, as std::function needs a copyable callback
+    std::optional<std::future<JobResult>> submit_future(auto &&submit)
+    {
+        auto promise = std::make_shared<std::promise<JobResult>>();
+        auto future = promise->get_future();
+        if (!submit([promise](JobResult r) { promise->set_value(std::move(r)); }))
+            return std::nullopt;
+        return future;
+    }
+}
+
+std::optional<std::future<JobResult>> JobPool::decode_future(std::vector<uint8_t> bytes, int bpp, Format format)
+{
+    return submit_future([&](Callback done) {
+        return submit_decode(std::move(bytes), bpp, format, std::move(done));
+    });
+}
+
+std::optional<std::future<JobResult>> JobPool::encode_future(std::vector<uint8_t> indices,
+    std::size_t width, std::size_t height, int bpp, Format format)
+{
+    return submit_future([&](Callback done) {
+        return submit_encode(std::move(indices), width, height, bpp, format, std::move(done));
+    });
+}
+
+JobPool::Awaiter JobPool::decode_async(std::vector<uint8_t> bytes, int bpp, Format format)
+{
+    return Awaiter([this, bytes = std::move(bytes), bpp, format](Callback done) mutable {
+        return submit_decode(std::move(bytes), bpp, format, std::move(done));
+    });
+}
+
+JobPool::Awaiter JobPool::encode_async(std::vector<uint8_t> indices, std::size_t width, std::size_t height,
+                                       int bpp, Format format)
+{
+    return Awaiter([this, indices = std::move(indices), width, height, bpp, format](Callback done) mutable {
+        return submit_encode(std::move(indices), width, height, bpp, format, std::move(done));
+    });
+}
+
+void ps1_read_texture(std::span<const uint8_t> vram, int page, std::size_t u, std::size_t v,
+                      std::size_t width, std::size_t height, int bpp, std::span<uint8_t> indices)
+{
+    assert((bpp == 4 || bpp == 8) && "PS1 textures can only use 4 or 8 BPP");
+    const std::size_t line_size = PS1_VRAM_WIDTH * 2;
+    assert(vram.size() >= line_size * PS1_VRAM_HEIGHT && "VRAM dump too small");
+    assert(indices.size() >= width * height && "not enough space for indexes");
+    // everything is converted to pixels on a line of VRAM
+    std::size_t x0 = (page % 16 * 64 * 16) / bpp + u;
+    std::size_t y0 = page / 16 * 256 + v;
+    assert(y0 + height <= PS1_VRAM_HEIGHT && x0 + width <= line_size * 8 / bpp
+        && "texture outside of VRAM");
+    for (std::size_t y = 0; y < height; y++) {
+        auto line = &vram[(y0 + y) * line_size];
+        auto out = &indices[y * width];
+        std::size_t x = x0;
+        // a texture may start on the high nibble, which the row kernel
+        // can't handle
+        if (bpp == 4 && x % 2 != 0 && width > 0) {
+            *out++ = line[x/2] >> 4;
+            x++;
+        }
+        packed::unpack_row(&line[x * bpp / 8], out, width - (x - x0), bpp, false);
+    }
+}
+
+std::vector<std::vector<uint8_t>> ps1_read_clut(std::span<const uint8_t> vram, int x, int y, int bpp)
+{
+    assert((bpp == 4 || bpp == 8) && "PS1 CLUTs can only have 16 or 256 colors");
+    std::size_t offset = (std::size_t(y) * PS1_VRAM_WIDTH + x * 16) * 2;
+    std::size_t num_colors = bpp_size(bpp);
+    assert(offset + num_colors * 2 <= vram.size() && "CLUT outside of VRAM");
+    std::vector<std::vector<uint8_t>> res;
+    for (std::size_t i = 0; i < num_colors; i++) {
+        unsigned c = vram[offset + i*2] | vram[offset + i*2 + 1] << 8;
+        // 5 bits to 8 bits, replicating the top bits into the low ones
+        auto expand = [](unsigned v) { return uint8_t(v << 3 | v >> 2); };
+        res.push_back({ expand(c & 0x1F), expand(c >> 5 & 0x1F), expand(c >> 10 & 0x1F),
+                        uint8_t(c == 0 ? 0 : 0xFF) });
+    }
+    return res;
+}
+
+namespace {
+    // copies one row of a tile. 8 pixels wide rows (the common case) are
+    // copied as a single 64-bit word.
+    inline void copy_tile_row(u8 *dst, const u8 *src, int tile_width)
+    {
+        if (tile_width == TILE_WIDTH)
+            std::memcpy(dst, src, TILE_WIDTH);
+        else
+            std::memcpy(dst, src, tile_width);
+    }
+}
+
+// both functions work on one band of tile_height rows at a time, so that
+// the rows being read or written stay in cache while the band's tiles
+// are visited
+void swizzle(std::span<const uint8_t> src, std::span<uint8_t> dst,
+             std::size_t width, std::size_t height, std::size_t pitch,
+             int tile_width, int tile_height)
+{
+    assert(width % tile_width == 0 && height % tile_height == 0
+        && "width and height must be multiples of the tile size");
+    std::size_t tile_size = tile_width * tile_height;
+    std::size_t tiles_per_row = width / tile_width;
+    for (std::size_t ty = 0; ty < height / tile_height; ty++) {
+        auto band = src.data() + ty * tile_height * pitch;
+        auto out  = dst.data() + ty * tiles_per_row * tile_size;
+        for (std::size_t tx = 0; tx < tiles_per_row; tx++)
+            for (int r = 0; r < tile_height; r++)
+                copy_tile_row(out + tx * tile_size + r * tile_width,
+                              band + r * pitch + tx * tile_width, tile_width);
+    }
+}
+
+void deswizzle(std::span<const uint8_t> src, std::span<uint8_t> dst,
+               std::size_t width, std::size_t height, std::size_t pitch,
+               int tile_width, int tile_height)
+{
+    assert(width % tile_width == 0 && height % tile_height == 0
+        && "width and height must be multiples of the tile size");
+    std::size_t tile_size = tile_width * tile_height;
+    std::size_t tiles_per_row = width / tile_width;
+    for (std::size_t ty = 0; ty < height / tile_height; ty++) {
+        auto in   = src.data() + ty * tiles_per_row * tile_size;
+        auto band = dst.data() + ty * tile_height * pitch;
+        for (std::size_t tx = 0; tx < tiles_per_row; tx++)
+            for (int r = 0; r < tile_height; r++)
+                copy_tile_row(band + r * pitch + tx * tile_width,
+                              in + tx * tile_size + r * tile_width, tile_width);
+    }
+}
+
+namespace {
+    u8 reverse_bits(u8 b)
+    {
+        b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+        b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+        b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+        return b;
+    }
+
+    // where the pixel at @x, @y is, on formats where every byte holds whole
+    // pixels (i.e. all but Planar and Interwined): byte offset inside the
+    // tile, and bit offset inside that byte
+    struct PixelPos { int byte, shift; };
+
+    PixelPos pixel_pos(Format format, int bpp, int x, int y)
+    {
+        switch (format) {
+        case Format::VirtualBoy: return { y*2 + x/4,     x%4 * 2 };
+        case Format::NGP:        return { y*2 + 1 - x/4, (3 - x%4) * 2 };
+        default:
+            if (bpp == 8)
+                return { y*8 + x, 0 };
+            return { y*4 + x/2, ((x & 1) ^ packed::high_first(format)) << 2 };
+        }
+    }
+
+    void for_each_tile(std::span<u8> tiles, int bpp, auto &&f)
+    {
+        std::size_t bpt = bpp*8;
+        assert(tiles.size() % bpt == 0 && "size of tiles not a multiple of bytes per tile");
+        for (std::size_t i = 0; i + bpt <= tiles.size(); i += bpt)
+            f(tiles.subspan(i, bpt));
+    }
+}
+
+namespace transforms {
+    // splits the 8 pixels of a row (@mask) by looking at one plane at a
+    // time. since a row only has 8 pixels, at most 8 branches survive to the
+    // last plane, which is where the new index gets ORed into the output.
+    void remap_row(const u8 *planes, int bpp, int plane, u8 mask, int value,
+                   std::span<const u8> map, u8 *out)
+    {
+        if (mask == 0)
+            return;
+        if (plane == bpp) {
+            for (int q = 0; q < bpp; q++)
+                if (getbit(map[value], q))
+                    out[q] |= mask;
+            return;
         }
+        remap_row(planes, bpp, plane + 1, mask & ~planes[plane], value, map, out);
+        remap_row(planes, bpp, plane + 1, mask &  planes[plane], value | 1 << plane, map, out);
+    }
+
+    void remap_planar(std::span<u8> tile, int bpp, Format format, std::span<const u8> map)
+    {
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            std::array<u8, MAX_BPP> planes = {}, out = {};
+            for (int p = 0; p < bpp; p++)
+                planes[p] = tile[plane_offset(format, bpp, p, y)];
+            remap_row(planes.data(), bpp, 0, 0xFF, 0, map, out.data());
+            for (int p = 0; p < bpp; p++)
+                tile[plane_offset(format, bpp, p, y)] = out[p];
+        }
+    }
+} // namespace transforms
+
+void flip_tiles_h(std::span<uint8_t> tiles, int bpp, Format format)
+{
+    for_each_tile(tiles, bpp, [&](std::span<u8> tile) {
+        if (is_planar(format)) {
+            for (auto &b : tile)
+                b = reverse_bits(b);
+            return;
+        }
+        // everything else: reverse the bytes of each row, then reverse the
+        // pixels inside each byte on 4 and 2 bpp
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            auto row = tile.subspan(y * bpp, bpp);
+            std::reverse(row.begin(), row.end());
+            for (auto &b : row) {
+                if (bpp <= 4)
+                    b = b << 4 | b >> 4;
+                if (bpp == 2)
+                    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+            }
+        }
+    });
+}
+
+void flip_tiles_v(std::span<uint8_t> tiles, int bpp, Format format)
+{
+    for_each_tile(tiles, bpp, [&](std::span<u8> tile) {
+        for (int y = 0; y < TILE_HEIGHT/2; y++) {
+            int y2 = TILE_HEIGHT - 1 - y;
+            if (is_planar(format)) {
+                for (int p = 0; p < bpp; p++)
+                    std::swap(tile[plane_offset(format, bpp, p, y)],
+                              tile[plane_offset(format, bpp, p, y2)]);
+            } else {
+                std::swap_ranges(tile.begin() + y  * bpp, tile.begin() + y*bpp + bpp,
+                                 tile.begin() + y2 * bpp);
+            }
+        }
+    });
+}
+
+void rotate_tiles_180(std::span<uint8_t> tiles, int bpp, Format format)
+{
+    flip_tiles_h(tiles, bpp, format);
+    flip_tiles_v(tiles, bpp, format);
+}
+
+void remap_tiles(std::span<uint8_t> tiles, int bpp, Format format,
+                 std::span<const uint8_t> map)
+{
+    assert(map.size() >= (1u << bpp) && "map is too small for the given bpp");
+    if (is_planar(format)) {
+        for_each_tile(tiles, bpp, [&](std::span<u8> tile) {
+            transforms::remap_planar(tile, bpp, format, map);
+        });
+        return;
+    }
+    // everything else: every byte holds one, two or four whole pixels, so
+    // a single 256 entry table does the job
+    std::array<u8, 256> table = {};
+    for (int b = 0; b < 256; b++)
+        for (int shift = 0; shift < 8; shift += bpp)
+            table[b] |= (map[getbits(b, shift, bpp)] & bitmask(bpp)) << shift;
+    for (auto &b : tiles)
+        b = table[b];
+}
+
+int get_pixel(std::span<const uint8_t> tile, int x, int y, int bpp, Format format)
+{
+    if (is_planar(format)) {
+        int res = 0;
+        for (int p = 0; p < bpp; p++)
+            res = setbit(res, p, getbit(tile[plane_offset(format, bpp, p, y)], 7 - x));
+        return res;
+    }
+    auto pos = pixel_pos(format, bpp, x, y);
+    return getbits(tile[pos.byte], pos.shift, bpp);
+}
+
+void set_pixel(std::span<uint8_t> tile, int x, int y, int index, int bpp, Format format)
+{
+    fill_rect(tile, x, y, 1, 1, index, bpp, format);
+}
+
+void fill_rect(std::span<uint8_t> tile, int x, int y, int width, int height,
+               int index, int bpp, Format format)
+{
+    int x0 = std::max(x, 0), x1 = std::min(x + width,  TILE_WIDTH);
+    int y0 = std::max(y, 0), y1 = std::min(y + height, TILE_HEIGHT);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    if (is_planar(format)) {
+        // columns x0..x1-1 correspond to bits 7-x0..8-x1
+        u8 mask = (0xFF >> x0) & ~(0xFF >> x1);
+        for (int r = y0; r < y1; r++) {
+            for (int p = 0; p < bpp; p++) {
+                auto &b = tile[plane_offset(format, bpp, p, r)];
+                b = (b & ~mask) | (getbit(index, p) ? mask : 0);
+            }
+        }
+        return;
+    }
+    for (int r = y0; r < y1; r++) {
+        if (bpp == 8) {
+            std::memset(&tile[r*8 + x0], index, x1 - x0);
+            continue;
+        }
+        for (int c = x0; c < x1; c++) {
+            auto pos = pixel_pos(format, bpp, c, r);
+            tile[pos.byte] = setbits(tile[pos.byte], pos.shift, bpp, index);
+        }
+    }
+}
+
+void set_pixels(std::span<uint8_t> tiles, std::span<const PixelWrite> writes,
+                int bpp, Format format)
+{
+    std::size_t bpt = bpp*8;
+    for (auto w : writes) {
+        if (w.x >= ROW_SIZE)
+            continue;
+        std::size_t n = w.y / TILE_HEIGHT * TILES_PER_ROW + w.x / TILE_WIDTH;
+        if ((n + 1) * bpt > tiles.size())
+            continue;
+        fill_rect(tiles.subspan(n * bpt, bpt), w.x % TILE_WIDTH, w.y % TILE_HEIGHT,
+                  1, 1, w.index, bpp, format);
+    }
+}
+
+namespace hashing {
+    constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr int LANES = 4;
+
+    constexpr inline uint64_t rotl(uint64_t x, int n) { return x << n | x >> (64 - n); }
+
+    // the 4 lanes are independent of each other, which lets the compiler
+    // keep them in vector registers (or at least pipeline the multiplies)
+    uint64_t hash(const u8 *data, std::size_t size)
+    {
+        std::array<uint64_t, LANES> acc = { PRIME1, PRIME2, ~PRIME1, ~PRIME2 };
+        std::size_t words = size / 8;
+        std::size_t i = 0;
+        for (; i + LANES <= words; i += LANES) {
+            std::array<uint64_t, LANES> w;
+            std::memcpy(w.data(), data + i*8, LANES*8);
+            for (int l = 0; l < LANES; l++)
+                acc[l] = rotl(acc[l] + w[l] * PRIME2, 31) * PRIME1;
+        }
+        for (int l = 0; i < words; i++, l++) {
+            uint64_t w;
+            std::memcpy(&w, data + i*8, 8);
+            acc[l] = rotl(acc[l] + w * PRIME2, 31) * PRIME1;
+        }
+        uint64_t h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        h ^= size * PRIME1;
+        // final avalanche
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+} // namespace hashing
+
+uint64_t hash_tile(std::span<const uint8_t> tile)
+{
+    assert(tile.size() % 8 == 0 && "tile size must be a multiple of 8");
+    return hashing::hash(tile.data(), tile.size());
+}
+
+void hash_tiles(std::span<const uint8_t> tiles, std::size_t tile_size,
+                std::span<uint64_t> hashes)
+{
+    std::size_t num_tiles = tiles.size() / tile_size;
+    assert(hashes.size() >= num_tiles && "not enough space for hashes");
+    for (std::size_t i = 0; i < num_tiles; i++)
+        hashes[i] = hashing::hash(tiles.data() + i * tile_size, tile_size);
+}
+
+uint64_t hash_tile_canonical(std::span<const uint8_t> tile, int bpp, Format format)
+{
+    std::size_t bpt = bpp*8;
+    std::array<u8, MAX_BPP*TILE_HEIGHT> buf;
+    std::span<u8> t{buf.data(), bpt};
+    std::copy(tile.begin(), tile.begin() + bpt, t.begin());
+    // visit the orientations in the order: none, H, HV, V
+    uint64_t h = hashing::hash(t.data(), bpt);
+    flip_tiles_h(t, bpp, format); h = std::min(h, hashing::hash(t.data(), bpt));
+    flip_tiles_v(t, bpp, format); h = std::min(h, hashing::hash(t.data(), bpt));
+    flip_tiles_h(t, bpp, format); h = std::min(h, hashing::hash(t.data(), bpt));
+    return h;
+}
+
+void hash_tiles_canonical(std::span<const uint8_t> tiles, int bpp, Format format,
+                          std::span<uint64_t> hashes)
+{
+    std::size_t bpt = bpp*8;
+    std::size_t num_tiles = tiles.size() / bpt;
+    assert(hashes.size() >= num_tiles && "not enough space for hashes");
+    for (std::size_t i = 0; i < num_tiles; i++)
+        hashes[i] = hash_tile_canonical(tiles.subspan(i * bpt, bpt), bpp, format);
+}
+
+namespace {
+    // bit-plane view of a tile, independent of its format: plane p holds the
+    // p-th bit of every pixel, with row y at byte y and column x at bit 7-x
+    // of that byte (i.e. the same layout as a Planar tile's plane).
+    using TilePlanes = std::array<uint64_t, MAX_BPP>;
+
+    TilePlanes to_planes(std::span<const u8> tile, int bpp, Format format)
+    {
+        TilePlanes planes = {};
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            if (is_planar(format)) {
+                for (int p = 0; p < bpp; p++)
+                    planes[p] |= uint64_t(tile[plane_offset(format, bpp, p, y)]) << y*8;
+                continue;
+            }
+            for (int x = 0; x < TILE_WIDTH; x++) {
+                auto v = get_pixel(tile, x, y, bpp, format);
+                for (int p = 0; p < bpp; p++)
+                    planes[p] |= getbit(v, p) << (y*8 + 7-x);
+            }
+        }
+        return planes;
+    }
+
+    // the inverse of to_planes(): writes @planes into @tile as @format
+    void from_planes(const TilePlanes &planes, int bpp, Format format, std::span<u8> tile)
+    {
+        if (is_planar(format)) {
+            for (int y = 0; y < TILE_HEIGHT; y++)
+                for (int p = 0; p < bpp; p++)
+                    tile[plane_offset(format, bpp, p, y)] = planes[p] >> y*8;
+            return;
+        }
+        std::array<u8, TILE_WIDTH * TILE_HEIGHT> indices;
+        for (int y = 0; y < TILE_HEIGHT; y++) {
+            for (int x = 0; x < TILE_WIDTH; x++) {
+                u8 v = 0;
+                for (int p = 0; p < bpp; p++)
+                    v |= getbit(planes[p], y*8 + 7-x) << p;
+                indices[y*TILE_WIDTH + x] = v;
+            }
+        }
+        auto res = encode_tile(indices, bpp, format);
+        std::copy_n(res.begin(), bpp*8, tile.begin());
+    }
+
+    // a pixel differs when any of its bits differ
+    int planes_distance(const uint64_t *a, const uint64_t *b, int bpp)
+    {
+        uint64_t diff = 0;
+        for (int p = 0; p < bpp; p++)
+            diff |= a[p] ^ b[p];
+        return std::popcount(diff);
+    }
+
+    // keeps @matches sorted and no longer than @max
+    void add_match(std::vector<TileMatch> &matches, TileMatch m, std::size_t max)
+    {
+        auto less = [](const TileMatch &a, const TileMatch &b) {
+            return a.distance != b.distance ? a.distance < b.distance : a.tile < b.tile;
+        };
+        if (matches.size() == max) {
+            if (max == 0 || !less(m, matches.back()))
+                return;
+            matches.pop_back();
+        }
+        matches.insert(std::upper_bound(matches.begin(), matches.end(), m, less), m);
+    }
+}
+
+int tile_distance(std::span<const uint8_t> a, std::span<const uint8_t> b,
+                  int bpp, Format format)
+{
+    auto pa = to_planes(a, bpp, format);
+    auto pb = to_planes(b, bpp, format);
+    return planes_distance(pa.data(), pb.data(), bpp);
+}
+
+namespace similarity {
+    // tiles are compared in blocks of this size, so that both blocks of
+    // planes stay in cache while every pair gets compared
+    constexpr std::size_t BLOCK_SIZE = 256;
+
+    // past this distance, splitting tiles in max_distance+1 sections leaves
+    // sections too small to be selective, so buckets stop paying off
+    constexpr int MAX_BUCKETED_DISTANCE = 7;
+
+    using Matches = std::vector<std::vector<TileMatch>>;
+
+    void compare_blocked(std::span<const uint64_t> planes, std::size_t num_tiles,
+                         int bpp, int max_distance, std::size_t max_matches,
+                         Matches &res)
+    {
+        // each plane's popcount difference is a lower bound of the distance,
+        // and it's cheaper than computing the full distance
+        std::vector<int> counts(num_tiles);
+        for (std::size_t i = 0; i < num_tiles; i++)
+            counts[i] = std::popcount(planes[i*bpp]);
+        for (std::size_t bi = 0; bi < num_tiles; bi += BLOCK_SIZE) {
+            for (std::size_t bj = bi; bj < num_tiles; bj += BLOCK_SIZE) {
+                auto ei = std::min(bi + BLOCK_SIZE, num_tiles);
+                auto ej = std::min(bj + BLOCK_SIZE, num_tiles);
+                for (auto i = bi; i < ei; i++) {
+                    for (auto j = std::max(bj, i+1); j < ej; j++) {
+                        if (std::abs(counts[i] - counts[j]) > max_distance)
+                            continue;
+                        int d = planes_distance(&planes[i*bpp], &planes[j*bpp], bpp);
+                        if (d <= max_distance) {
+                            add_match(res[i], { j, d }, max_matches);
+                            add_match(res[j], { i, d }, max_matches);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // if two tiles differ by at most d pixels, then splitting both of them
+    // in d+1 sections means at least one section is identical in both. so
+    // only tiles sharing a bucket of identical sections are compared.
+    void compare_bucketed(std::span<const uint64_t> planes, std::size_t num_tiles,
+                          int bpp, int max_distance, std::size_t max_matches,
+                          Matches &res)
+    {
+        int num_sections = max_distance + 1;
+        std::vector<uint64_t> masks(num_sections);
+        for (int s = 0; s < num_sections; s++) {
+            int lo = 64 *  s      / num_sections;
+            int hi = 64 * (s + 1) / num_sections;
+            masks[s] = (hi == 64 ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+        }
+        auto section_key = [&](std::size_t t, int s) {
+            std::array<uint64_t, MAX_BPP> parts = {};
+            for (int p = 0; p < bpp; p++)
+                parts[p] = planes[t*bpp + p] & masks[s];
+            return hashing::hash(reinterpret_cast<const u8 *>(parts.data()), bpp*8);
+        };
+        std::vector<std::unordered_map<uint64_t, std::vector<std::size_t>>> buckets(num_sections);
+        for (std::size_t t = 0; t < num_tiles; t++)
+            for (int s = 0; s < num_sections; s++)
+                buckets[s][section_key(t, s)].push_back(t);
+        // the same pair may share more than one bucket: remember which tile
+        // was last compared against each candidate
+        std::vector<std::size_t> seen(num_tiles, SIZE_MAX);
+        for (std::size_t i = 0; i < num_tiles; i++) {
+            for (int s = 0; s < num_sections; s++) {
+                for (auto j : buckets[s][section_key(i, s)]) {
+                    if (j <= i || seen[j] == i)
+                        continue;
+                    seen[j] = i;
+                    int d = planes_distance(&planes[i*bpp], &planes[j*bpp], bpp);
+                    if (d <= max_distance) {
+                        add_match(res[i], { j, d }, max_matches);
+                        add_match(res[j], { i, d }, max_matches);
+                    }
+                }
+            }
+        }
+    }
+} // namespace similarity
+
+std::vector<std::vector<TileMatch>> find_similar_tiles(
+    std::span<const uint8_t> tiles,
+    int bpp,
+    Format format,
+    int max_distance,
+    std::size_t max_matches
+)
+{
+    std::size_t bpt = bpp*8;
+    std::size_t num_tiles = tiles.size() / bpt;
+    std::vector<uint64_t> planes(num_tiles * bpp);
+    for (std::size_t t = 0; t < num_tiles; t++) {
+        auto p = to_planes(tiles.subspan(t * bpt, bpt), bpp, format);
+        std::copy(p.begin(), p.begin() + bpp, planes.begin() + t*bpp);
+    }
+    similarity::Matches res(num_tiles);
+    if (max_distance < 0)
+        return res;
+    if (max_distance <= similarity::MAX_BUCKETED_DISTANCE)
+        similarity::compare_bucketed(planes, num_tiles, bpp, max_distance, max_matches, res);
+    else
+        similarity::compare_blocked(planes, num_tiles, bpp, max_distance, max_matches, res);
+    return res;
+}
+
+namespace {
+    // calls f(i) for every i in [0, n), splitting the range between threads
+    // (at most @max_threads, if not 0)
+    void parallel_for(std::size_t n, auto &&f, std::size_t max_threads = 0)
+    {
+        std::size_t num_threads = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1u), n);
+        if (max_threads != 0)
+            num_threads = std::min(num_threads, max_threads);
+        if (num_threads <= 1) {
+            for (std::size_t i = 0; i < n; i++)
+                f(i);
+            return;
+        }
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                for (std::size_t i = n * t / num_threads; i < n * (t+1) / num_threads; i++)
+                    f(i);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+    }
+}
+
+namespace reduction {
+    constexpr int MAX_ITERATIONS = 16;
+
+    struct Clusters {
+        std::span<const uint64_t> planes;
+        std::span<const std::size_t> weights;
+        int bpp;
+        std::vector<std::size_t> medoids;
+        std::vector<std::size_t> assignment;
+        std::vector<int> distance;
+
+        int dist(std::size_t a, std::size_t b) const
+        {
+            return planes_distance(&planes[a*bpp], &planes[b*bpp], bpp);
+        }
+
+        // k-means++ style seeding, without the randomness: start from the
+        // most common tile, then keep picking whatever tile would contribute
+        // the most error if it stayed where it is
+        void seed(std::size_t k)
+        {
+            std::size_t n = weights.size();
+            auto first = std::max_element(weights.begin(), weights.end()) - weights.begin();
+            medoids = { std::size_t(first) };
+            distance.assign(n, 0);
+            assignment.assign(n, 0);
+            for (std::size_t i = 0; i < n; i++)
+                distance[i] = dist(i, first);
+            while (medoids.size() < k) {
+                std::size_t best = 0, best_cost = 0;
+                for (std::size_t i = 0; i < n; i++) {
+                    if (distance[i] * weights[i] > best_cost) {
+                        best = i;
+                        best_cost = distance[i] * weights[i];
+                    }
+                }
+                if (best_cost == 0)
+                    break;
+                medoids.push_back(best);
+                parallel_for(n, [&](std::size_t i) {
+                    int d = dist(i, best);
+                    if (d < distance[i]) {
+                        distance[i] = d;
+                        assignment[i] = medoids.size() - 1;
+                    }
+                });
+            }
+        }
+
+        void assign()
+        {
+            parallel_for(weights.size(), [&](std::size_t i) {
+                int best = INT_MAX;
+                for (std::size_t m = 0; m < medoids.size(); m++) {
+                    int d = dist(i, medoids[m]);
+                    if (d < best) {
+                        best = d;
+                        assignment[i] = m;
+                    }
+                }
+                distance[i] = best;
+            });
+        }
+
+        // moves each medoid to the member with the lowest total weighted
+        // distance to the rest of its cluster. returns whether any moved.
+        bool update()
+        {
+            std::vector<std::vector<std::size_t>> members(medoids.size());
+            for (std::size_t i = 0; i < assignment.size(); i++)
+                members[assignment[i]].push_back(i);
+            std::vector<char> changed(medoids.size(), 0);
+            parallel_for(medoids.size(), [&](std::size_t m) {
+                std::size_t best = medoids[m], best_cost = SIZE_MAX;
+                for (auto c : members[m]) {
+                    std::size_t cost = 0;
+                    for (auto j : members[m]) {
+                        cost += dist(c, j) * weights[j];
+                        if (cost >= best_cost)
+                            break;
+                    }
+                    if (cost < best_cost) {
+                        best = c;
+                        best_cost = cost;
+                    }
+                }
+                changed[m] = best != medoids[m];
+                medoids[m] = best;
+            });
+            return std::find(changed.begin(), changed.end(), 1) != changed.end();
+        }
+    };
+} // namespace reduction
+
+ReducedTiles reduce_tiles(
+    std::span<const uint8_t> tiles,
+    int bpp,
+    Format format,
+    std::size_t max_tiles
+)
+{
+    std::size_t bpt = bpp*8;
+    std::size_t num_tiles = tiles.size() / bpt;
+    auto tile = [&](std::size_t i) { return tiles.subspan(i * bpt, bpt); };
+
+    // merge identical tiles first
+    std::vector<std::size_t> uniques, weights, unique_of(num_tiles);
+    std::unordered_map<uint64_t, std::vector<std::size_t>> by_hash;
+    for (std::size_t i = 0; i < num_tiles; i++) {
+        auto &candidates = by_hash[hash_tile(tile(i))];
+        auto it = std::find_if(candidates.begin(), candidates.end(), [&](std::size_t u) {
+            return std::equal(tile(i).begin(), tile(i).end(), tile(uniques[u]).begin());
+        });
+        if (it != candidates.end()) {
+            unique_of[i] = *it;
+            weights[*it]++;
+            continue;
+        }
+        unique_of[i] = uniques.size();
+        candidates.push_back(uniques.size());
+        uniques.push_back(i);
+        weights.push_back(1);
+    }
+
+    std::vector<uint64_t> planes(uniques.size() * bpp);
+    parallel_for(uniques.size(), [&](std::size_t u) {
+        auto p = to_planes(tile(uniques[u]), bpp, format);
+        std::copy(p.begin(), p.begin() + bpp, planes.begin() + u*bpp);
+    });
+
+    reduction::Clusters clusters;
+    clusters.planes  = planes;
+    clusters.weights = weights;
+    clusters.bpp     = bpp;
+    if (uniques.size() <= max_tiles) {
+        clusters.medoids.resize(uniques.size());
+        for (std::size_t u = 0; u < uniques.size(); u++)
+            clusters.medoids[u] = u;
+        clusters.assignment = clusters.medoids;
+        clusters.distance.assign(uniques.size(), 0);
+    } else if (max_tiles > 0) {
+        clusters.seed(max_tiles);
+        for (int i = 0; i < reduction::MAX_ITERATIONS && clusters.update(); i++)
+            clusters.assign();
+    }
+
+    ReducedTiles res;
+    if (clusters.medoids.empty())
+        return res;
+    for (auto m : clusters.medoids) {
+        auto t = tile(uniques[m]);
+        res.tiles.insert(res.tiles.end(), t.begin(), t.end());
+    }
+    res.tilemap.resize(num_tiles);
+    res.errors.resize(num_tiles);
+    for (std::size_t i = 0; i < num_tiles; i++) {
+        auto u = unique_of[i];
+        res.tilemap[i] = clusters.assignment[u];
+        res.errors[i]  = clusters.distance[u];
+        res.total_error += res.errors[i];
+        res.max_error = std::max(res.max_error, res.errors[i]);
+    }
+    return res;
+}
+
+namespace nes {
+    constexpr std::size_t CELL_SIZE = 16;
+    constexpr int MAX_COLORS = 64;
+    constexpr int COLORS_PER_PALETTE = 3; // not counting the background color
+    constexpr std::size_t MAX_SEARCH_NODES = 1 << 16;
+
+    // each set of colors is a bitmask of color ids. a set fits a sub-palette
+    // if their union has at most 3 colors; sets are tried biggest first,
+    // with a depth-first search over which sub-palette gets each one.
+    struct PaletteSearch {
+        std::span<const uint64_t> sets;
+        std::size_t max_palettes;
+        std::vector<uint64_t> palettes = {};
+        std::size_t nodes = 0;
+
+        bool search(std::size_t i)
+        {
+            if (i == sets.size())
+                return true;
+            if (++nodes > MAX_SEARCH_NODES)
+                return false;
+            // try the sub-palettes that need the fewest new colors first,
+            // which makes the first path down the tree a best-fit greedy
+            std::array<std::pair<int, std::size_t>, 4> order;
+            std::size_t n = 0;
+            for (std::size_t p = 0; p < palettes.size(); p++) {
+                int size = std::popcount(palettes[p] | sets[i]);
+                if (size > COLORS_PER_PALETTE)
+                    continue;
+                std::pair<int, std::size_t> entry = { size - std::popcount(palettes[p]), p };
+                std::size_t k = n++;
+                for (; k > 0 && entry < order[k-1]; k--)
+                    order[k] = order[k-1];
+                order[k] = entry;
+            }
+            for (std::size_t k = 0; k < n; k++) {
+                auto p = order[k].second;
+                auto old = palettes[p];
+                palettes[p] |= sets[i];
+                if (search(i + 1))
+                    return true;
+                palettes[p] = old;
+                // the set was already covered: no other choice can do better
+                if (order[k].first == 0)
+                    return false;
+            }
+            if (palettes.size() < max_palettes) {
+                palettes.push_back(sets[i]);
+                if (search(i + 1))
+                    return true;
+                palettes.pop_back();
+            }
+            return false;
+        }
+    };
+
+    // returns the sub-palettes that fit every cell, using @bg as the shared
+    // background color, or an empty vector if there are none
+    std::vector<uint64_t> find_palettes(std::span<const uint64_t> cells, int bg,
+                                        std::size_t max_palettes)
+    {
+        std::vector<uint64_t> sets;
+        for (auto c : cells) {
+            auto s = c & ~(1ULL << bg);
+            if (std::popcount(s) > COLORS_PER_PALETTE)
+                return {};
+            sets.push_back(s);
+        }
+        std::sort(sets.begin(), sets.end(), [](uint64_t a, uint64_t b) {
+            return std::popcount(a) != std::popcount(b) ? std::popcount(a) > std::popcount(b) : a < b;
+        });
+        sets.erase(std::unique(sets.begin(), sets.end()), sets.end());
+        // a subset of another set goes wherever the bigger set goes
+        std::vector<uint64_t> maximal;
+        for (auto s : sets)
+            if (std::none_of(maximal.begin(), maximal.end(), [&](uint64_t m) { return (s & m) == s; }))
+                maximal.push_back(s);
+        PaletteSearch search = { .sets = maximal, .max_palettes = max_palettes };
+        if (!search.search(0))
+            return {};
+        if (search.palettes.empty())
+            search.palettes.push_back(0);
+        return search.palettes;
+    }
+
+    uint32_t pack_color(std::span<const u8> color)
+    {
+        uint32_t res = 0;
+        std::memcpy(&res, color.data(), color.size());
+        return res;
+    }
+} // namespace nes
+
+std::optional<NesBackground> make_nes_background(
+    std::span<const uint8_t> data,
+    std::size_t width,
+    std::size_t height,
+    int channels,
+    int num_palettes
+)
+{
+    assert(width % nes::CELL_SIZE == 0 && height % nes::CELL_SIZE == 0
+        && "width and height must be multiples of 16");
+    assert(num_palettes >= 1 && num_palettes <= 4 && "the NES has at most 4 sub-palettes");
+    NesBackground res;
+
+    // give every color an id, so that a cell's colors become a bitmask
+    std::unordered_map<uint32_t, int> ids;
+    std::vector<u8> color_of(width * height);
+    for (std::size_t i = 0; i < width * height; i++) {
+        auto color = data.subspan(i * channels, channels);
+        auto [it, inserted] = ids.try_emplace(nes::pack_color(color), ids.size());
+        if (inserted) {
+            if (ids.size() > nes::MAX_COLORS)
+                return std::nullopt;
+            res.colors.emplace_back(color.begin(), color.end());
+        }
+        color_of[i] = it->second;
+    }
+
+    std::size_t cells_w = width / nes::CELL_SIZE, cells_h = height / nes::CELL_SIZE;
+    std::vector<uint64_t> cells(cells_w * cells_h, 0);
+    for (std::size_t y = 0; y < height; y++)
+        for (std::size_t x = 0; x < width; x++)
+            cells[y / nes::CELL_SIZE * cells_w + x / nes::CELL_SIZE] |= 1ULL << color_of[y * width + x];
+
+    // any color could be the background color: try the ones found in more
+    // cells first, all of them in parallel, and keep the first that works
+    std::vector<int> candidates(res.colors.size());
+    std::vector<int> num_cells(res.colors.size(), 0);
+    for (std::size_t c = 0; c < candidates.size(); c++) {
+        candidates[c] = c;
+        for (auto cell : cells)
+            num_cells[c] += getbit(cell, c);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [&](int a, int b) {
+        return num_cells[a] > num_cells[b];
+    });
+    std::vector<std::vector<uint64_t>> solutions(candidates.size());
+    parallel_for(candidates.size(), [&](std::size_t i) {
+        solutions[i] = nes::find_palettes(cells, candidates[i], num_palettes);
+    });
+    auto found = std::find_if(solutions.begin(), solutions.end(), [](const auto &s) { return !s.empty(); });
+    if (found == solutions.end())
+        return std::nullopt;
+    int bg = candidates[found - solutions.begin()];
+    auto &palettes = *found;
+
+    // a palette's colors are ordered by id, which gives each color its index
+    std::vector<std::array<u8, nes::MAX_COLORS>> index_of(palettes.size());
+    for (auto p : palettes) {
+        std::array<u8, 4> pal = { u8(bg), u8(bg), u8(bg), u8(bg) };
+        int n = 1;
+        for (int c = 0; c < nes::MAX_COLORS; c++) {
+            if (getbit(p, c)) {
+                index_of[res.palettes.size()][c] = n;
+                pal[n++] = c;
+            }
+        }
+        index_of[res.palettes.size()][bg] = 0;
+        res.palettes.push_back(pal);
+    }
+
+    std::vector<u8> cell_palette(cells.size());
+    res.attributes.assign((width + 31) / 32 * ((height + 31) / 32), 0);
+    for (std::size_t cy = 0; cy < cells_h; cy++) {
+        for (std::size_t cx = 0; cx < cells_w; cx++) {
+            auto cell = cells[cy * cells_w + cx] & ~(1ULL << bg);
+            auto p = std::find_if(palettes.begin(), palettes.end(), [&](uint64_t pal) {
+                return (cell & pal) == cell;
+            }) - palettes.begin();
+            cell_palette[cy * cells_w + cx] = p;
+            auto &attr = res.attributes[cy/2 * ((width + 31) / 32) + cx/2];
+            attr = setbits(attr, (cy % 2 * 2 + cx % 2) * 2, 2, p);
+        }
+    }
+
+    std::vector<u8> indices(width * height);
+    for (std::size_t y = 0; y < height; y++) {
+        for (std::size_t x = 0; x < width; x++) {
+            auto p = cell_palette[y / nes::CELL_SIZE * cells_w + x / nes::CELL_SIZE];
+            indices[y * width + x] = index_of[p][color_of[y * width + x]];
+        }
+    }
+
+    std::unordered_map<uint64_t, std::vector<u8>> tiles;
+    bool too_many_tiles = false;
+    encode(indices, width, height, 2, Format::Planar, [&](std::span<u8> tile) {
+        auto &candidates = tiles[hash_tile(tile)];
+        for (auto t : candidates) {
+            if (std::equal(tile.begin(), tile.end(), res.chr.begin() + t * tile.size())) {
+                res.nametable.push_back(t);
+                return;
+            }
+        }
+        std::size_t num_tiles = res.chr.size() / tile.size();
+        if (num_tiles > 0xFF) {
+            too_many_tiles = true;
+            return;
+        }
+        candidates.push_back(num_tiles);
+        res.nametable.push_back(num_tiles);
+        res.chr.insert(res.chr.end(), tile.begin(), tile.end());
+    });
+    if (too_many_tiles)
+        return std::nullopt;
+    return res;
+}
+
+namespace quantization {
+    constexpr int MAX_CHANNELS = 4;
+    constexpr int KMEANS_ITERATIONS = 4;
+    constexpr std::size_t CHUNK_SIZE = 1 << 16; // pixels per chunk
+
+    // how many bits of each channel make up a histogram bin: fewer channels
+    // can afford more precise bins
+    int bin_bits(int channels) { return channels <= 2 ? 8 : channels == 3 ? 5 : 4; }
+
+    std::size_t bin_of(const u8 *color, int channels)
+    {
+        int bits = bin_bits(channels);
+        std::size_t bin = 0;
+        for (int c = 0; c < channels; c++)
+            bin = bin << bits | color[c] >> (8 - bits);
+        return bin;
+    }
+
+    // a whole color in a single number, so that colors can be looked up exactly
+    uint32_t key_of(const u8 *color, int channels)
+    {
+        uint32_t key = 0;
+        for (int c = 0; c < channels; c++)
+            key = key << 8 | color[c];
+        return key;
+    }
+
+    // the distinct colors of @data, in the order they first appear. stops
+    // (returning std::nullopt) once there are more than @max of them
+    std::optional<std::vector<uint32_t>> exact_colors(std::span<const u8> data, int channels, std::size_t max)
+    {
+        std::unordered_set<uint32_t> seen;
+        std::vector<uint32_t> colors;
+        for (std::size_t i = 0; i + channels <= data.size(); i += channels) {
+            auto key = key_of(&data[i], channels);
+            if (!seen.insert(key).second)
+                continue;
+            if (colors.size() == max)
+                return std::nullopt;
+            colors.push_back(key);
+        }
+        return colors;
+    }
+
+    // every bin keeps the sum of the colors inside, so that averages use the
+    // real colors instead of the bin's center
+    struct Bin {
+        uint64_t count = 0;
+        std::array<uint64_t, MAX_CHANNELS> sum = {};
+    };
+
+    struct Entry {
+        std::array<float, MAX_CHANNELS> color;
+        uint64_t count;
+    };
+
+    std::vector<Entry> histogram(std::span<const u8> data, int channels)
+    {
+        std::size_t num_pixels = data.size() / channels;
+        std::size_t num_bins = std::size_t(1) << (bin_bits(channels) * channels);
+        std::size_t num_chunks = (num_pixels + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::size_t num_parts = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1u), num_chunks);
+        std::vector<std::vector<Bin>> parts(num_parts, std::vector<Bin>(num_bins));
+        parallel_for(num_parts, [&](std::size_t p) {
+            auto &bins = parts[p];
+            for (auto i = num_pixels * p / num_parts; i < num_pixels * (p+1) / num_parts; i++) {
+                auto color = &data[i * channels];
+                auto &bin = bins[bin_of(color, channels)];
+                bin.count++;
+                for (int c = 0; c < channels; c++)
+                    bin.sum[c] += color[c];
+            }
+        });
+        std::vector<Entry> entries;
+        for (std::size_t b = 0; b < num_bins; b++) {
+            Bin total;
+            for (auto &part : parts) {
+                total.count += part[b].count;
+                for (int c = 0; c < channels; c++)
+                    total.sum[c] += part[b].sum[c];
+            }
+            if (total.count == 0)
+                continue;
+            Entry e = { {}, total.count };
+            for (int c = 0; c < channels; c++)
+                e.color[c] = float(total.sum[c]) / total.count;
+            entries.push_back(e);
+        }
+        return entries;
+    }
+
+    float distance(const float *a, const float *b, int channels)
+    {
+        float d = 0;
+        for (int c = 0; c < channels; c++)
+            d += (a[c] - b[c]) * (a[c] - b[c]);
+        return d;
+    }
+
+    std::size_t nearest(const float *color, std::span<const std::array<float, MAX_CHANNELS>> palette, int channels)
+    {
+        std::size_t best = 0;
+        float best_dist = INFINITY;
+        for (std::size_t i = 0; i < palette.size(); i++) {
+            float d = distance(color, palette[i].data(), channels);
+            if (d < best_dist) {
+                best = i;
+                best_dist = d;
+            }
+        }
+        return best;
+    }
+
+    std::array<float, MAX_CHANNELS> mean(std::span<const Entry> entries, int channels)
+    {
+        std::array<float, MAX_CHANNELS> sum = {};
+        double count = 0;
+        for (auto &e : entries) {
+            for (int c = 0; c < channels; c++)
+                sum[c] += e.color[c] * e.count;
+            count += e.count;
+        }
+        for (int c = 0; c < channels; c++)
+            sum[c] /= count;
+        return sum;
+    }
+
+    // repeatedly splits the box with the widest channel range (weighted by
+    // how many pixels it has) at its median
+    std::vector<std::array<float, MAX_CHANNELS>> median_cut(std::vector<Entry> &entries,
+                                                            int channels, int num_colors)
+    {
+        struct Box { std::size_t begin, end; int channel; float score; };
+        auto make_box = [&](std::size_t begin, std::size_t end) {
+            Box box = { begin, end, 0, 0 };
+            uint64_t count = 0;
+            for (auto i = begin; i < end; i++)
+                count += entries[i].count;
+            for (int c = 0; c < channels; c++) {
+                auto [lo, hi] = std::minmax_element(entries.begin() + begin, entries.begin() + end,
+                    [&](const Entry &a, const Entry &b) { return a.color[c] < b.color[c]; });
+                float range = hi->color[c] - lo->color[c];
+                if (range * count > box.score) {
+                    box.channel = c;
+                    box.score = range * count;
+                }
+            }
+            return box;
+        };
+        std::vector<Box> boxes = { make_box(0, entries.size()) };
+        while (boxes.size() < std::size_t(num_colors)) {
+            auto it = std::max_element(boxes.begin(), boxes.end(), [](const Box &a, const Box &b) {
+                return a.score < b.score;
+            });
+            if (it->score == 0)
+                break;
+            auto box = *it;
+            auto first = entries.begin() + box.begin, last = entries.begin() + box.end;
+            std::sort(first, last, [&](const Entry &a, const Entry &b) {
+                return a.color[box.channel] < b.color[box.channel];
+            });
+            uint64_t total = 0, half = 0;
+            for (auto e = first; e != last; ++e)
+                total += e->count;
+            // both halves must get at least one entry
+            std::size_t split = box.begin + 1;
+            for (; split + 1 < box.end; split++)
+                if ((half += entries[split - 1].count) >= total / 2)
+                    break;
+            *it = make_box(box.begin, split);
+            boxes.push_back(make_box(split, box.end));
+        }
+        std::vector<std::array<float, MAX_CHANNELS>> palette;
+        for (auto &box : boxes)
+            palette.push_back(mean(std::span(entries).subspan(box.begin, box.end - box.begin), channels));
+        return palette;
+    }
+
+    void kmeans(std::span<const Entry> entries, std::vector<std::array<float, MAX_CHANNELS>> &palette,
+                int channels)
+    {
+        std::vector<std::size_t> assignment(entries.size());
+        for (int it = 0; it < KMEANS_ITERATIONS; it++) {
+            parallel_for((entries.size() + CHUNK_SIZE - 1) / CHUNK_SIZE, [&](std::size_t chunk) {
+                for (auto i = chunk * CHUNK_SIZE; i < std::min(entries.size(), (chunk+1) * CHUNK_SIZE); i++)
+                    assignment[i] = nearest(entries[i].color.data(), palette, channels);
+            });
+            std::vector<std::array<double, MAX_CHANNELS>> sums(palette.size());
+            std::vector<uint64_t> counts(palette.size());
+            for (std::size_t i = 0; i < entries.size(); i++) {
+                for (int c = 0; c < channels; c++)
+                    sums[assignment[i]][c] += entries[i].color[c] * entries[i].count;
+                counts[assignment[i]] += entries[i].count;
+            }
+            for (std::size_t p = 0; p < palette.size(); p++)
+                if (counts[p] != 0)
+                    for (int c = 0; c < channels; c++)
+                        palette[p][c] = sums[p][c] / counts[p];
+        }
+    }
+} // namespace quantization
+
+std::vector<std::vector<uint8_t>> make_palette(
+    std::span<const uint8_t> data,
+    int channels,
+    int num_colors
+)
+{
+    assert(channels >= 1 && channels <= quantization::MAX_CHANNELS && "invalid number of channels");
+    if (num_colors <= 0)
+        return {};
+    // images that already fit keep their colors as they are
+    if (auto exact = quantization::exact_colors(data, channels, num_colors)) {
+        std::vector<std::vector<uint8_t>> res;
+        for (auto key : *exact) {
+            std::vector<u8> c(channels);
+            for (int i = channels - 1; i >= 0; i--, key >>= 8)
+                c[i] = key & 0xFF;
+            res.push_back(c);
+        }
+        return res;
+    }
+    auto entries = quantization::histogram(data, channels);
+    if (entries.empty())
+        return {};
+    auto palette = quantization::median_cut(entries, channels, num_colors);
+    quantization::kmeans(entries, palette, channels);
+    std::vector<std::vector<uint8_t>> res;
+    for (auto &color : palette) {
+        std::vector<u8> c(channels);
+        for (int i = 0; i < channels; i++)
+            c[i] = std::clamp(std::lround(color[i]), 0L, 255L);
+        res.push_back(c);
+    }
+    return res;
+}
+
+void make_indexed_nearest(
+    std::span<const uint8_t> data,
+    std::span<const std::vector<uint8_t>> palette,
+    int channels,
+    std::span<uint8_t> indices
+)
+{
+    using namespace quantization;
+    std::size_t num_pixels = data.size() / channels;
+    assert(indices.size() >= num_pixels && "not enough space for indices");
+    std::vector<std::array<float, MAX_CHANNELS>> pal(palette.size());
+    for (std::size_t i = 0; i < palette.size(); i++)
+        for (int c = 0; c < channels; c++)
+            pal[i][c] = palette[i][c];
+
+    // the nearest color is found once for each distinct color, then every
+    // pixel looks its own up
+    auto colors = exact_colors(data, channels, SIZE_MAX).value();
+    std::vector<u8> nearest_of(colors.size());
+    parallel_for((colors.size() + CHUNK_SIZE - 1) / CHUNK_SIZE, [&](std::size_t chunk) {
+        for (auto i = chunk * CHUNK_SIZE; i < std::min(colors.size(), (chunk+1) * CHUNK_SIZE); i++) {
+            std::array<float, MAX_CHANNELS> color;
+            auto key = colors[i];
+            for (int c = channels - 1; c >= 0; c--, key >>= 8)
+                color[c] = key & 0xFF;
+            nearest_of[i] = nearest(color.data(), pal, channels);
+        }
+    });
+    std::unordered_map<uint32_t, u8> lut;
+    for (std::size_t i = 0; i < colors.size(); i++)
+        lut.emplace(colors[i], nearest_of[i]);
+    parallel_for((num_pixels + CHUNK_SIZE - 1) / CHUNK_SIZE, [&](std::size_t chunk) {
+        for (auto i = chunk * CHUNK_SIZE; i < std::min(num_pixels, (chunk+1) * CHUNK_SIZE); i++)
+            indices[i] = lut.find(key_of(&data[i * channels], channels))->second;
+    });
+}
+
+TileCache::TileCache(std::span<const uint8_t> tiles, int bpp, Format format)
+    : tiles(tiles), tile_bpp(bpp), tile_format(format),
+      decoded(tiles.size() / (bpp*8)), valid(decoded.size(), false)
+{ }
+
+const DecodedTile &TileCache::get(std::size_t n)
+{
+    assert(n < decoded.size() && "tile number out of range");
+    if (valid[n])
+        return decoded[n];
+    std::size_t bpt = tile_bpp*8;
+    auto &d = decoded[n];
+    decode_tile(tiles.subspan(n * bpt, bpt), tile_bpp, tile_format, d.pixels.data());
+    d.opaque = 0;
+    for (int i = 0; i < TILE_WIDTH * TILE_HEIGHT; i++)
+        d.opaque |= uint64_t(d.pixels[i] != 0) << i;
+    valid[n] = true;
+    return d;
+}
+
+void TileCache::load_all()
+{
+    for (std::size_t n = 0; n < decoded.size(); n++)
+        get(n);
+}
+
+void pack_nibbles(std::span<const uint8_t> indices, std::span<uint8_t> packed)
+{
+    assert(indices.size() % 2 == 0 && "size of indices not even");
+    assert(packed.size() >= indices.size() / 2 && "packed buffer too small");
+    packed::pack(indices.data(), packed.data(), indices.size(), false);
+}
+
+void unpack_nibbles(std::span<const uint8_t> packed, std::span<uint8_t> indices)
+{
+    assert(indices.size() >= packed.size() * 2 && "indices buffer too small");
+    packed::unpack(packed.data(), indices.data(), packed.size() * 2, false);
+}
+
+DecodedTile unpack_tile(const PackedTile &tile)
+{
+    DecodedTile res;
+    unpack_nibbles(tile.pixels, res.pixels);
+    res.opaque = tile.opaque;
+    return res;
+}
+
+PackedTileCache::PackedTileCache(std::span<const uint8_t> tiles, int bpp, Format format)
+    : tiles(tiles), tile_bpp(bpp), tile_format(format),
+      decoded(tiles.size() / (bpp*8)), valid(decoded.size(), false)
+{
+    assert(bpp <= 4 && "packed tiles only hold up to 4 bpp");
+}
+
+const PackedTile &PackedTileCache::get(std::size_t n)
+{
+    assert(n < decoded.size() && "tile number out of range");
+    if (valid[n])
+        return decoded[n];
+    std::size_t bpt = tile_bpp*8;
+    std::array<u8, TILE_WIDTH * TILE_HEIGHT> pixels;
+    decode_tile(tiles.subspan(n * bpt, bpt), tile_bpp, tile_format, pixels.data());
+    auto &d = decoded[n];
+    pack_nibbles(pixels, d.pixels);
+    d.opaque = 0;
+    for (int i = 0; i < TILE_WIDTH * TILE_HEIGHT; i++)
+        d.opaque |= uint64_t(pixels[i] != 0) << i;
+    valid[n] = true;
+    return d;
+}
+
+void PackedTileCache::load_all()
+{
+    for (std::size_t n = 0; n < decoded.size(); n++)
+        get(n);
+}
+
+namespace sprites {
+    struct Frame {
+        std::span<u8> pixels;
+        std::size_t width, height;
+    };
+
+    void blit(const DecodedTile &tile, Frame frame, int x, int y,
+              bool hflip, bool vflip, u8 base)
+    {
+        for (int r = 0; r < TILE_HEIGHT; r++) {
+            int fy = y + r;
+            if (fy < 0 || std::size_t(fy) >= frame.height)
+                continue;
+            int ty = vflip ? TILE_HEIGHT - 1 - r : r;
+            u8 mask = tile.opaque >> ty*8;
+            if (mask == 0)
+                continue;
+            auto src = &tile.pixels[ty*8];
+            auto dst = &frame.pixels[fy * frame.width];
+            // fully opaque rows, entirely inside the frame, skip the mask
+            if (mask == 0xFF && x >= 0 && std::size_t(x) + TILE_WIDTH <= frame.width) {
+                for (int c = 0; c < TILE_WIDTH; c++)
+                    dst[x + c] = base | src[hflip ? TILE_WIDTH - 1 - c : c];
+                continue;
+            }
+            for (int c = 0; c < TILE_WIDTH; c++) {
+                int tx = hflip ? TILE_WIDTH - 1 - c : c;
+                int fx = x + c;
+                if (getbit(mask, tx) && fx >= 0 && std::size_t(fx) < frame.width)
+                    dst[fx] = base | src[tx];
+            }
+        }
+    }
+
+    void draw(TileCache &cache, const Sprite &s, Frame frame)
+    {
+        int tiles_w = s.size == SpriteSize::Size16x16 ? 2 : 1;
+        int tiles_h = s.size == SpriteSize::Size8x8   ? 1 : 2;
+        u8 base = s.palette << cache.bpp();
+        for (int ty = 0; ty < tiles_h; ty++) {
+            for (int tx = 0; tx < tiles_w; tx++) {
+                auto n = s.size == SpriteSize::Size8x16 ? s.tile + ty
+                       : s.tile + ty * TILES_PER_ROW + tx;
+                if (n >= cache.size())
+                    continue;
+                // flipping a sprite also swaps the position of its tiles
+                int dx = s.hflip ? tiles_w - 1 - tx : tx;
+                int dy = s.vflip ? tiles_h - 1 - ty : ty;
+                blit(cache.get(n), frame, s.x + dx * TILE_WIDTH, s.y + dy * TILE_HEIGHT,
+                     s.hflip, s.vflip, base);
+            }
+        }
+    }
+
+    void render(TileCache &cache, std::span<const Sprite> sprites, Frame frame)
+    {
+        // painter's algorithm: whatever is on top gets drawn last
+        std::vector<std::size_t> order(sprites.size());
+        for (std::size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return sprites[a].priority != sprites[b].priority
+                 ? sprites[a].priority > sprites[b].priority
+                 : a > b;
+        });
+        for (auto i : order)
+            draw(cache, sprites[i], frame);
+    }
+} // namespace sprites
+
+void render_sprites(
+    TileCache &cache,
+    std::span<const Sprite> sprites,
+    std::span<uint8_t> frame,
+    std::size_t width,
+    std::size_t height
+)
+{
+    assert(frame.size() >= width * height && "frame is too small");
+    sprites::render(cache, sprites, { frame, width, height });
+}
+
+void render_frames(
+    TileCache &cache,
+    std::span<const std::span<const Sprite>> frames,
+    std::span<uint8_t> output,
+    std::size_t width,
+    std::size_t height
+)
+{
+    assert(output.size() >= frames.size() * width * height && "output is too small");
+    // decode every tile used beforehand: after that, the cache is only read
+    // from and can be shared between threads
+    for (auto sprites : frames) {
+        for (auto &s : sprites) {
+            int num_tiles = s.size == SpriteSize::Size8x8 ? 1 : s.size == SpriteSize::Size8x16 ? 2 : 4;
+            for (int i = 0; i < num_tiles; i++) {
+                auto n = s.size == SpriteSize::Size8x16 ? s.tile + i
+                       : s.tile + i/2 * TILES_PER_ROW + i%2;
+                if (n < cache.size())
+                    cache.get(n);
+            }
+        }
+    }
+    parallel_for(frames.size(), [&](std::size_t f) {
+        sprites::render(cache, frames[f], { output.subspan(f * width * height, width * height), width, height });
+    });
+}
+
+namespace background {
+    // a cache holding whole lines of the background, rendered the first
+    // time any scanline needs them
+    struct LineCache {
+        TileCache &cache;
+        std::span<const MapEntry> map;
+        std::size_t map_width;
+        std::vector<u8> pixels;
+        std::vector<bool> valid;
+
+        LineCache(TileCache &cache, std::span<const MapEntry> map,
+                  std::size_t map_width, std::size_t map_height)
+            : cache(cache), map(map), map_width(map_width),
+              pixels(map_width * TILE_WIDTH * map_height * TILE_HEIGHT),
+              valid(map_height * TILE_HEIGHT, false)
+        { }
+
+        std::size_t line_width() const { return map_width * TILE_WIDTH; }
+
+        std::span<const u8> get(std::size_t y)
+        {
+            auto line = std::span(pixels).subspan(y * line_width(), line_width());
+            if (valid[y])
+                return line;
+            auto entries = map.subspan(y / TILE_HEIGHT * map_width, map_width);
+            for (std::size_t tx = 0; tx < map_width; tx++) {
+                auto &e = entries[tx];
+                auto dst = &line[tx * TILE_WIDTH];
+                if (e.tile >= cache.size()) {
+                    std::fill(dst, dst + TILE_WIDTH, 0);
+                    continue;
+                }
+                int ty = e.vflip ? TILE_HEIGHT - 1 - y % TILE_HEIGHT : y % TILE_HEIGHT;
+                auto src = &cache.get(e.tile).pixels[ty * TILE_WIDTH];
+                u8 base = e.palette << cache.bpp();
+                for (int c = 0; c < TILE_WIDTH; c++)
+                    dst[c] = base | src[e.hflip ? TILE_WIDTH - 1 - c : c];
+            }
+            valid[y] = true;
+            return line;
+        }
+    };
+
+    std::size_t wrap(int value, std::size_t size)
+    {
+        auto r = value % (long) size;
+        return r < 0 ? r + size : r;
+    }
+} // namespace background
+
+void render_background(
+    TileCache &cache,
+    std::span<const MapEntry> map,
+    std::size_t map_width,
+    std::size_t map_height,
+    std::span<const ScanlineParams> lines,
+    std::span<uint8_t> frame,
+    std::size_t width,
+    std::size_t height
+)
+{
+    assert(map.size() >= map_width * map_height && "map is too small");
+    assert(frame.size() >= width * height && "frame is too small");
+    if (map_width == 0 || map_height == 0)
+        return;
+    background::LineCache line_cache(cache, map, map_width, map_height);
+    auto bg_width  = map_width  * TILE_WIDTH;
+    auto bg_height = map_height * TILE_HEIGHT;
+    ScanlineParams params;
+    for (std::size_t y = 0; y < height; y++) {
+        if (y < lines.size())
+            params = lines[y];
+        auto src = line_cache.get(background::wrap(int(y) + params.scroll_y, bg_height));
+        auto dst = frame.subspan(y * width, width);
+        // copy the visible part of the line, one wrap-around at a time
+        std::size_t x = 0, sx = background::wrap(params.scroll_x, bg_width);
+        while (x < width) {
+            auto count = std::min(width - x, bg_width - sx);
+            std::copy(src.begin() + sx, src.begin() + sx + count, dst.begin() + x);
+            x += count;
+            sx = 0;
+        }
+        if (params.palette_bank != 0) {
+            u8 offset = params.palette_bank << cache.bpp();
+            for (auto &p : dst)
+                p += offset;
+        }
+    }
+}
+
+namespace {
+    // little endian numbers, for containers and compressed tiles
+    void put16(std::vector<u8> &v, uint32_t x) { v.push_back(x); v.push_back(x >> 8); }
+    void put32(std::vector<u8> &v, uint32_t x) { put16(v, x); put16(v, x >> 16); }
+
+    uint32_t get32(std::span<const u8> s, std::size_t off)
+    {
+        return s[off] | s[off+1] << 8 | s[off+2] << 16 | uint32_t(s[off+3]) << 24;
+    }
+
+    void set32(std::vector<u8> &v, std::size_t off, uint32_t x)
+    {
+        for (int i = 0; i < 4; i++)
+            v[off + i] = x >> i*8;
+    }
+}
+
+namespace rans {
+    // a static, order-0 rANS coder with byte-wise renormalization. symbol
+    // frequencies are scaled to PROB_SCALE and stored before the data
+    constexpr int PROB_BITS = 12;
+    constexpr uint32_t PROB_SCALE = 1u << PROB_BITS;
+    constexpr uint32_t LOWER_BOUND = 1u << 23;
+
+    using Freqs = std::array<uint32_t, 256>;
+
+    // scales the counts of @data so that they add up to PROB_SCALE, keeping
+    // every symbol that appears at 1 at least
+    Freqs normalize(std::span<const u8> data)
+    {
+        Freqs counts = {}, freqs = {};
+        for (auto b : data)
+            counts[b]++;
+        uint32_t total = 0;
+        for (int s = 0; s < 256; s++) {
+            if (counts[s] != 0) {
+                freqs[s] = std::max<uint64_t>(1, uint64_t(counts[s]) * PROB_SCALE / data.size());
+                total += freqs[s];
+            }
+        }
+        // rounding leaves the total a bit off: the most frequent symbols
+        // are the ones that suffer the least from fixing it
+        while (total != PROB_SCALE) {
+            auto it = std::max_element(freqs.begin(), freqs.end());
+            uint32_t diff = total < PROB_SCALE ? PROB_SCALE - total : std::min(total - PROB_SCALE, *it - 1);
+            *it = total < PROB_SCALE ? *it + diff : *it - diff;
+            total = total < PROB_SCALE ? total + diff : total - diff;
+        }
+        return freqs;
+    }
+
+    Freqs cumulative(const Freqs &freqs)
+    {
+        Freqs starts = {};
+        for (int s = 1; s < 256; s++)
+            starts[s] = starts[s-1] + freqs[s-1];
+        return starts;
+    }
+
+    // frequency table: a 256-bit map of which symbols appear, then the
+    // frequency - 1 of each one, in 1 byte if < 128 and 2 bytes otherwise
+    void put_freqs(const Freqs &freqs, std::vector<u8> &out)
+    {
+        for (int i = 0; i < 256; i += 8) {
+            u8 bits = 0;
+            for (int j = 0; j < 8; j++)
+                bits |= (freqs[i+j] != 0) << j;
+            out.push_back(bits);
+        }
+        for (auto f : freqs) {
+            if (f == 0)
+                continue;
+            if (f - 1 < 128)
+                out.push_back(f - 1);
+            else {
+                out.push_back(0x80 | (f - 1) >> 8);
+                out.push_back((f - 1) & 0xFF);
+            }
+        }
+    }
+
+    bool get_freqs(std::span<const u8> data, std::size_t &pos, Freqs &freqs)
+    {
+        if (data.size() < 32)
+            return false;
+        pos = 32;
+        uint32_t total = 0;
+        for (int s = 0; s < 256; s++) {
+            freqs[s] = 0;
+            if (!getbit(data[s/8], s%8))
+                continue;
+            if (pos >= data.size())
+                return false;
+            uint32_t f = data[pos++];
+            if (f >= 128) {
+                if (pos >= data.size())
+                    return false;
+                f = (f & 0x7F) << 8 | data[pos++];
+            }
+            freqs[s] = f + 1;
+            total += f + 1;
+        }
+        return total == PROB_SCALE;
+    }
+
+    void encode(std::span<const u8> data, std::vector<u8> &out)
+    {
+        auto freqs = normalize(data);
+        auto starts = cumulative(freqs);
+        put_freqs(freqs, out);
+        // symbols are encoded last to first, and the output comes out
+        // backwards too, so that the decoder can go forward
+        std::vector<u8> buf;
+        uint32_t x = LOWER_BOUND;
+        for (auto i = data.size(); i-- > 0; ) {
+            uint32_t f = freqs[data[i]];
+            uint32_t x_max = ((LOWER_BOUND >> PROB_BITS) << 8) * f;
+            while (x >= x_max) {
+                buf.push_back(x & 0xFF);
+                x >>= 8;
+            }
+            x = (x / f << PROB_BITS) + x % f + starts[data[i]];
+        }
+        for (int i = 0; i < 4; i++, x >>= 8)
+            buf.push_back(x & 0xFF);
+        out.insert(out.end(), buf.rbegin(), buf.rend());
+    }
+
+    bool decode(std::span<const u8> data, std::span<u8> out)
+    {
+        Freqs freqs;
+        std::size_t pos;
+        if (!get_freqs(data, pos, freqs) || pos + 4 > data.size())
+            return false;
+        auto starts = cumulative(freqs);
+        std::array<u8, PROB_SCALE> symbols;
+        for (int s = 0; s < 256; s++)
+            std::fill_n(&symbols[starts[s]], freqs[s], s);
+        uint32_t x = 0;
+        for (int i = 0; i < 4; i++)
+            x = x << 8 | data[pos++];
+        for (auto &o : out) {
+            uint32_t slot = x & (PROB_SCALE - 1);
+            o = symbols[slot];
+            x = freqs[o] * (x >> PROB_BITS) + slot - starts[o];
+            while (x < LOWER_BOUND) {
+                if (pos == data.size())
+                    return false;
+                x = x << 8 | data[pos++];
+            }
+        }
+        return pos == data.size() && x == LOWER_BOUND;
+    }
+} // namespace rans
+
+namespace codec {
+    // layout, all numbers little endian:
+    // header:      "RGTC", u8 version, u8 format, u8 bpp, u8 unused,
+    //              u32 tiles, u32 tiles per block, u32 blocks
+    // block table: one u32 size for each block
+    // blocks:      the streams of the block one after another: tokens,
+    //              match distances, then one stream per plane. a stream
+    //              is a u32 decoded size, a u32 stored size, a u8 method
+    //              and the data.
+    // each tile has a token: a match is a u16 distance back to an equal
+    // tile of the same block, while a literal stores its planes with each
+    // row XORed with the one above, so that repeated rows become zeroes.
+    const char MAGIC[4] = { 'R', 'G', 'T', 'C' };
+    const u8 VERSION = 1;
+    const std::size_t HEADER_SIZE = 20;
+    const std::size_t TILES_PER_BLOCK = 4096;
+
+    enum Token : u8 { LITERAL, MATCH };
+    enum Method : u8 { RAW, RANS };
+
+    // rows are bytes, so shifting by 8 lines up each row with the next one
+    uint64_t delta_rows(uint64_t p) { return p ^ p << 8; }
+
+    uint64_t undelta_rows(uint64_t d)
+    {
+        d ^= d << 8;
+        d ^= d << 16;
+        d ^= d << 32;
+        return d;
+    }
+
+    void put_stream(std::span<const u8> data, std::vector<u8> &out)
+    {
+        std::vector<u8> coded;
+        if (!data.empty())
+            rans::encode(data, coded);
+        bool use_rans = !data.empty() && coded.size() < data.size();
+        put32(out, data.size());
+        put32(out, use_rans ? coded.size() : data.size());
+        out.push_back(use_rans ? RANS : RAW);
+        if (use_rans)
+            out.insert(out.end(), coded.begin(), coded.end());
+        else
+            out.insert(out.end(), data.begin(), data.end());
+    }
+
+    // reads the stream at @pos and moves @pos past it
+    bool get_stream(std::span<const u8> data, std::size_t &pos, std::vector<u8> &out)
+    {
+        if (pos + 9 > data.size())
+            return false;
+        std::size_t size = get32(data, pos), stored = get32(data, pos + 4);
+        u8 method = data[pos + 8];
+        pos += 9;
+        if (stored > data.size() - pos || (method == RAW && stored != size) || method > RANS)
+            return false;
+        auto src = data.subspan(pos, stored);
+        pos += stored;
+        // a rANS stream can't decode to more than 2^31 symbols per byte
+        // of input in theory, but anything beyond a block's worth is corrupt
+        if (size > TILES_PER_BLOCK * MAX_BPP * 8 + TILES_PER_BLOCK * 2)
+            return false;
+        out.resize(size);
+        if (method == RAW) {
+            std::copy(src.begin(), src.end(), out.begin());
+            return true;
+        }
+        return rans::decode(src, out);
+    }
+
+    void compress_block(std::span<const u8> tiles, int bpp, Format format, std::vector<u8> &out)
+    {
+        std::size_t bpt = bpp*8;
+        std::vector<u8> tokens, distances;
+        std::vector<std::vector<u8>> planes(bpp);
+        // only the last tile with a given hash is remembered, which keeps
+        // distances short
+        std::unordered_map<uint64_t, std::size_t> last;
+        for (std::size_t i = 0; i < tiles.size() / bpt; i++) {
+            auto tile = tiles.subspan(i * bpt, bpt);
+            auto [it, inserted] = last.try_emplace(hash_tile(tile), i);
+            if (!inserted && std::equal(tile.begin(), tile.end(), &tiles[it->second * bpt])) {
+                tokens.push_back(MATCH);
+                put16(distances, i - it->second);
+            } else {
+                tokens.push_back(LITERAL);
+                auto p = to_planes(tile, bpp, format);
+                for (int j = 0; j < bpp; j++) {
+                    auto d = delta_rows(p[j]);
+                    for (int y = 0; y < TILE_HEIGHT; y++)
+                        planes[j].push_back(d >> y*8);
+                }
+            }
+            it->second = i;
+        }
+        put_stream(tokens, out);
+        put_stream(distances, out);
+        for (auto &p : planes)
+            put_stream(p, out);
+    }
+
+    bool decompress_block(std::span<const u8> data, int bpp, Format format, std::span<u8> tiles)
+    {
+        std::size_t bpt = bpp*8, num_tiles = tiles.size() / bpt, pos = 0;
+        std::vector<u8> tokens, distances;
+        std::vector<std::vector<u8>> planes(bpp);
+        if (!get_stream(data, pos, tokens) || !get_stream(data, pos, distances))
+            return false;
+        for (auto &p : planes)
+            if (!get_stream(data, pos, p))
+                return false;
+        std::size_t matches = std::count(tokens.begin(), tokens.end(), MATCH);
+        if (pos != data.size() || tokens.size() != num_tiles || distances.size() != matches * 2)
+            return false;
+        for (auto &p : planes)
+            if (p.size() != (num_tiles - matches) * 8)
+                return false;
+
+        std::size_t next_dist = 0, next_plane = 0;
+        for (std::size_t i = 0; i < num_tiles; i++) {
+            auto tile = tiles.subspan(i * bpt, bpt);
+            if (tokens[i] == MATCH) {
+                std::size_t dist = distances[next_dist] | distances[next_dist+1] << 8;
+                next_dist += 2;
+                if (dist == 0 || dist > i)
+                    return false;
+                std::copy_n(&tiles[(i - dist) * bpt], bpt, tile.begin());
+                continue;
+            }
+            if (tokens[i] != LITERAL)
+                return false;
+            TilePlanes p = {};
+            for (int j = 0; j < bpp; j++) {
+                uint64_t d = 0;
+                for (int y = 0; y < TILE_HEIGHT; y++)
+                    d |= uint64_t(planes[j][next_plane + y]) << y*8;
+                p[j] = undelta_rows(d);
+            }
+            next_plane += 8;
+            from_planes(p, bpp, format, tile);
+        }
+        return true;
+    }
+} // namespace codec
+
+std::vector<uint8_t> compress_tiles(std::span<const uint8_t> tiles, int bpp, Format format)
+{
+    std::size_t bpt = bpp*8;
+    assert(tiles.size() % bpt == 0 && "size of tiles not a multiple of bytes per tile");
+    std::size_t num_tiles = tiles.size() / bpt;
+    std::size_t num_blocks = (num_tiles + codec::TILES_PER_BLOCK - 1) / codec::TILES_PER_BLOCK;
+    std::vector<std::vector<u8>> blocks(num_blocks);
+    parallel_for(num_blocks, [&](std::size_t b) {
+        auto start = b * codec::TILES_PER_BLOCK * bpt;
+        auto size = std::min(tiles.size() - start, codec::TILES_PER_BLOCK * bpt);
+        codec::compress_block(tiles.subspan(start, size), bpp, format, blocks[b]);
+    });
+
+    std::vector<u8> res(codec::MAGIC, codec::MAGIC + 4);
+    res.push_back(codec::VERSION);
+    res.push_back(u8(format));
+    res.push_back(bpp);
+    res.push_back(0);
+    for (auto n : { num_tiles, codec::TILES_PER_BLOCK, num_blocks })
+        put32(res, n);
+    for (auto &b : blocks)
+        put32(res, b.size());
+    for (auto &b : blocks)
+        res.insert(res.end(), b.begin(), b.end());
+    return res;
+}
+
+std::optional<CompressedTiles> compressed_tiles_info(std::span<const uint8_t> data)
+{
+    using namespace codec;
+    if (data.size() < HEADER_SIZE || !std::equal(MAGIC, MAGIC + 4, data.begin()) || data[4] != VERSION)
+        return std::nullopt;
+    CompressedTiles info = { .bpp = data[6], .format = Format(data[5]), .num_tiles = get32(data, 8) };
+    std::size_t tiles_per_block = get32(data, 12), num_blocks = get32(data, 16);
+    if (!format_to_string(info.format) || !format_supports_bpp(info.format, info.bpp)
+     || tiles_per_block == 0 || tiles_per_block > TILES_PER_BLOCK
+     || num_blocks != (info.num_tiles + tiles_per_block - 1) / tiles_per_block
+     || num_blocks > (data.size() - HEADER_SIZE) / 4)
+        return std::nullopt;
+    return info;
+}
+
+bool decompress_tiles(std::span<const uint8_t> data, std::function<void(std::span<uint8_t>)> write_data)
+{
+    auto info = compressed_tiles_info(data);
+    if (!info)
+        return false;
+    std::size_t bpt = info->bpp * 8;
+    std::size_t tiles_per_block = get32(data, 12), num_blocks = get32(data, 16);
+    std::size_t pos = codec::HEADER_SIZE + num_blocks * 4;
+    std::vector<u8> buf(tiles_per_block * bpt);
+    for (std::size_t b = 0; b < num_blocks; b++) {
+        std::size_t size = get32(data, codec::HEADER_SIZE + b*4);
+        std::size_t tiles = std::min(tiles_per_block, info->num_tiles - b * tiles_per_block);
+        if (size > data.size() - pos)
+            return false;
+        auto out = std::span(buf).first(tiles * bpt);
+        if (!codec::decompress_block(data.subspan(pos, size), info->bpp, info->format, out))
+            return false;
+        write_data(out);
+        pos += size;
+    }
+    return pos == data.size();
+}
+
+namespace container {
+    // layout, all numbers little endian:
+    // header:      "RGFX", u16 version, u8 format, u8 bpp, u8 tile width,
+    //              u8 tile height, u8 channels, u8 flags, u32 colors,
+    //              u32 tiles, u32 unique tiles, u32 tiles per block,
+    //              u32 blocks
+    // palette:     colors * channels bytes, padded to 4 bytes
+    // index:       one u32 per tile, the number of its unique tile
+    // block table: one u32 offset (from the start of the file) and one
+    //              u32 size for each block. blocks whose size is smaller
+    //              than their decompressed size are compressed, with the
+    //              method the flags say
+    // blocks
+    const char MAGIC[4] = { 'R', 'G', 'F', 'X' };
+    const int VERSION = 1;
+    const std::size_t HEADER_SIZE = 32;
+    const std::size_t TILES_PER_BLOCK = 256;
+    const u8 FLAG_RLE        = 1;
+    const u8 FLAG_TILE_CODEC = 2;
+
+    // PackBits: a header byte n < 128 is followed by n+1 literal bytes, while
+    // n > 128 repeats the next byte 257-n times
+    void compress(std::span<const u8> data, std::vector<u8> &out)
+    {
+        std::size_t i = 0;
+        while (i < data.size()) {
+            std::size_t run = 1;
+            while (i + run < data.size() && run < 128 && data[i + run] == data[i])
+                run++;
+            if (run >= 2) {
+                out.push_back(257 - run);
+                out.push_back(data[i]);
+                i += run;
+                continue;
+            }
+            // literals go on until a run of at least 2 starts
+            std::size_t start = i++;
+            while (i < data.size() && i - start < 128
+                && !(i + 1 < data.size() && data[i] == data[i+1]))
+                i++;
+            out.push_back(i - start - 1);
+            out.insert(out.end(), data.begin() + start, data.begin() + i);
+        }
+    }
+
+    bool decompress(std::span<const u8> data, std::span<u8> out)
+    {
+        std::size_t o = 0;
+        for (std::size_t i = 0; i < data.size(); ) {
+            u8 n = data[i++];
+            if (n < 128) {
+                std::size_t len = n + 1;
+                if (i + len > data.size() || o + len > out.size())
+                    return false;
+                std::copy(&data[i], &data[i] + len, &out[o]);
+                i += len;
+                o += len;
+            } else if (n > 128) {
+                std::size_t len = 257 - n;
+                if (i >= data.size() || o + len > out.size())
+                    return false;
+                std::fill(&out[o], &out[o] + len, data[i++]);
+                o += len;
+            }
+        }
+        return o == out.size();
+    }
+} // namespace container
+
+std::vector<uint8_t> write_container(std::span<const uint8_t> tiles, int bpp, Format format,
+                                     std::span<const uint8_t> palette, int channels, Compression compression)
+{
+    std::size_t bpt = bpp*8;
+    assert(tiles.size() % bpt == 0 && "size of tiles not a multiple of bytes per tile");
+    assert((channels == 0 || palette.size() % channels == 0) && "size of palette not a multiple of channels");
+
+    // deduplicate: equal hashes are checked byte by byte, just in case
+    std::size_t num_tiles = tiles.size() / bpt;
+    std::vector<uint32_t> index(num_tiles);
+    std::vector<u8> unique;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> seen;
+    for (std::size_t i = 0; i < num_tiles; i++) {
+        auto tile = tiles.subspan(i * bpt, bpt);
+        auto &candidates = seen[hash_tile(tile)];
+        auto it = std::find_if(candidates.begin(), candidates.end(), [&](uint32_t u) {
+            return std::equal(tile.begin(), tile.end(), unique.begin() + u * bpt);
+        });
+        if (it != candidates.end()) {
+            index[i] = *it;
+            continue;
+        }
+        index[i] = unique.size() / bpt;
+        candidates.push_back(index[i]);
+        unique.insert(unique.end(), tile.begin(), tile.end());
+    }
+
+    std::size_t num_unique = unique.size() / bpt;
+    std::size_t num_blocks = (num_unique + container::TILES_PER_BLOCK - 1) / container::TILES_PER_BLOCK;
+    std::size_t num_colors = channels == 0 ? 0 : palette.size() / channels;
+    std::vector<u8> res(container::MAGIC, container::MAGIC + 4);
+    put16(res, container::VERSION);
+    res.push_back(u8(format));
+    res.push_back(bpp);
+    res.push_back(TILE_WIDTH);
+    res.push_back(TILE_HEIGHT);
+    res.push_back(channels);
+    res.push_back(compression == Compression::RLE   ? container::FLAG_RLE
+                : compression == Compression::Tiles ? container::FLAG_TILE_CODEC
+                : 0);
+    for (auto n : { num_colors, num_tiles, num_unique, container::TILES_PER_BLOCK, num_blocks })
+        put32(res, n);
+    res.insert(res.end(), palette.begin(), palette.end());
+    res.resize((res.size() + 3) / 4 * 4, 0);
+    for (auto u : index)
+        put32(res, u);
+    std::size_t table = res.size();
+    res.resize(res.size() + num_blocks * 8);
+
+    std::vector<std::vector<u8>> packed(num_blocks);
+    auto block_data = [&](std::size_t b) {
+        auto start = b * container::TILES_PER_BLOCK * bpt;
+        return std::span(unique).subspan(start, std::min(unique.size() - start,
+                                                         container::TILES_PER_BLOCK * bpt));
+    };
+    parallel_for(compression == Compression::None ? 0 : num_blocks, [&](std::size_t b) {
+        if (compression == Compression::RLE)
+            container::compress(block_data(b), packed[b]);
+        else
+            packed[b] = compress_tiles(block_data(b), bpp, format);
+    });
+    for (std::size_t b = 0; b < num_blocks; b++) {
+        auto data = block_data(b);
+        bool use_packed = compression != Compression::None && packed[b].size() < data.size();
+        set32(res, table + b*8,     res.size());
+        set32(res, table + b*8 + 4, use_packed ? packed[b].size() : data.size());
+        if (use_packed)
+            res.insert(res.end(), packed[b].begin(), packed[b].end());
+        else
+            res.insert(res.end(), data.begin(), data.end());
+    }
+    return res;
+}
+
+std::optional<Container> read_container(std::span<const uint8_t> file)
+{
+    using namespace container;
+    if (file.size() < HEADER_SIZE || !std::equal(MAGIC, MAGIC + 4, file.begin())
+     || (file[4] | file[5] << 8) != VERSION)
+        return std::nullopt;
+    Container c;
+    c.file            = file;
+    c.tile_format     = Format(file[6]);
+    c.tile_bpp        = file[7];
+    c.num_channels    = file[10];
+    c.flags           = file[11];
+    c.num_colors      = get32(file, 12);
+    c.num_tiles       = get32(file, 16);
+    c.num_unique      = get32(file, 20);
+    c.tiles_per_block = get32(file, 24);
+    c.num_blocks      = get32(file, 28);
+    if (!format_to_string(c.tile_format) || !format_supports_bpp(c.tile_format, c.tile_bpp)
+     || file[8] != TILE_WIDTH || file[9] != TILE_HEIGHT
+     || c.tiles_per_block == 0 || c.tiles_per_block > TILES_PER_BLOCK
+     || (c.flags != 0 && c.flags != FLAG_RLE && c.flags != FLAG_TILE_CODEC)
+     || c.num_blocks != (c.num_unique + c.tiles_per_block - 1) / c.tiles_per_block)
+        return std::nullopt;
+    // uint64_t, so that huge values from corrupt headers can't overflow
+    uint64_t palette_size = uint64_t(c.num_colors) * c.num_channels;
+    c.palette_offset = HEADER_SIZE;
+    c.index_offset   = c.palette_offset + (palette_size + 3) / 4 * 4;
+    c.table_offset   = c.index_offset + uint64_t(c.num_tiles) * 4;
+    if (palette_size > file.size() || uint64_t(c.table_offset) + uint64_t(c.num_blocks) * 8 > file.size())
+        return std::nullopt;
+    for (std::size_t i = 0; i < c.num_tiles; i++)
+        if (get32(file, c.index_offset + i*4) >= c.num_unique)
+            return std::nullopt;
+    std::size_t bpt = c.tile_bpp * 8;
+    for (std::size_t b = 0; b < c.num_blocks; b++) {
+        uint64_t offset = get32(file, c.table_offset + b*8);
+        uint64_t size   = get32(file, c.table_offset + b*8 + 4);
+        uint64_t tiles  = std::min(c.tiles_per_block, c.num_unique - b * c.tiles_per_block);
+        if (offset + size > file.size() || size > tiles * bpt)
+            return std::nullopt;
+    }
+    return c;
+}
+
+std::size_t Container::unique_index(std::size_t n) const
+{
+    assert(n < num_tiles && "tile number out of range");
+    return get32(file, index_offset + n*4);
+}
+
+std::span<const uint8_t> Container::block(std::size_t b, std::span<uint8_t> buf) const
+{
+    assert(b < num_blocks && "block number out of range");
+    std::size_t offset = get32(file, table_offset + b*8);
+    std::size_t size   = get32(file, table_offset + b*8 + 4);
+    std::size_t tiles  = std::min(tiles_per_block, num_unique - b * tiles_per_block);
+    std::size_t raw_size = tiles * tile_bpp * 8;
+    auto data = file.subspan(offset, size);
+    if (size == raw_size)
+        return data;
+    assert(buf.size() >= raw_size && "buffer too small for a block");
+    if (flags == container::FLAG_TILE_CODEC) {
+        auto info = compressed_tiles_info(data);
+        std::size_t written = 0;
+        if (!info || info->bpp != tile_bpp || info->format != tile_format || info->num_tiles != tiles
+         || !decompress_tiles(data, [&](std::span<uint8_t> out) {
+                std::copy(out.begin(), out.end(), &buf[written]);
+                written += out.size();
+            }))
+            return {};
+    } else if (!container::decompress(data, buf.first(raw_size)))
+        return {};
+    return buf.first(raw_size);
+}
+
+std::span<const uint8_t> Container::tile(std::size_t n, std::span<uint8_t> buf) const
+{
+    std::size_t u = unique_index(n);
+    std::size_t bpt = tile_bpp * 8;
+    auto data = block(u / tiles_per_block, buf);
+    if (data.empty())
+        return {};
+    return data.subspan(u % tiles_per_block * bpt, bpt);
+}
+
+std::vector<uint8_t> Container::tiles() const
+{
+    std::size_t bpt = tile_bpp * 8;
+    std::vector<u8> unique, buf(block_size());
+    for (std::size_t b = 0; b < num_blocks; b++) {
+        auto data = block(b, buf);
+        if (data.empty())
+            return {};
+        unique.insert(unique.end(), data.begin(), data.end());
+    }
+    std::vector<u8> res(num_tiles * bpt);
+    for (std::size_t n = 0; n < num_tiles; n++)
+        std::copy_n(&unique[unique_index(n) * bpt], bpt, &res[n * bpt]);
+    return res;
+}
+
+void decode_image(std::span<const uint8_t> bytes, int bpp, Format format, std::span<uint8_t> image,
+                  unsigned max_threads)
+{
+    std::size_t band_size = bpp*8 * TILES_PER_ROW;
+    std::size_t num_bands = (bytes.size() + band_size - 1) / band_size;
+    assert(image.size() >= num_bands * ROW_SIZE * TILE_HEIGHT && "image too small");
+    std::size_t rows = band_rows, tasks = (num_bands + rows - 1) / rows;
+    unsigned threads = num_bands < parallel_rows ? 1 : num_threads.load();
+    if (max_threads != 0)
+        threads = threads == 0 ? max_threads : std::min(threads, max_threads);
+    parallel_for(tasks, [&](std::size_t t) {
+        for (std::size_t b = t * rows; b < std::min((t+1) * rows, num_bands); b++) {
+            auto out = &image[b * ROW_SIZE * TILE_HEIGHT];
+            decode_band(bytes.subspan(b * band_size, std::min(band_size, bytes.size() - b * band_size)),
+                        bpp, format, [&](std::span<int> row) {
+                out = std::copy(row.begin(), row.end(), out);
+            });
+        }
+    }, threads);
+}
+
+Tuning get_tuning()
+{
+    return { row_kernel, band_rows, num_threads, parallel_rows };
+}
+
+void set_tuning(const Tuning &tuning)
+{
+    row_kernel    = tuning.kernel;
+    band_rows     = std::max<std::size_t>(tuning.band_rows, 1);
+    num_threads   = tuning.threads;
+    parallel_rows = tuning.parallel_rows;
+}
+
+namespace tuning {
+    // the cache is a single line of text, only valid for the same version
+    // of the file and the same number of cores
+    const int VERSION = 2;
+
+    std::optional<Tuning> load(std::string_view path, unsigned cores)
+    {
+        FILE *f = std::fopen(std::string(path).c_str(), "r");
+        if (!f)
+            return std::nullopt;
+        int version, kernel;
+        unsigned file_cores, threads;
+        std::size_t rows, min_rows;
+        int n = std::fscanf(f, "retrogfx-tuning %d %u %d %zu %u %zu", &version, &file_cores, &kernel, &rows,
+                            &threads, &min_rows);
+        std::fclose(f);
+        if (n != 6 || version != VERSION || file_cores != cores
+         || kernel < 0 || kernel > int(RowKernel::SWAR) || rows == 0)
+            return std::nullopt;
+        return Tuning { RowKernel(kernel), rows, threads, min_rows };
+    }
+
+    void save(std::string_view path, unsigned cores, const Tuning &t)
+    {
+        if (FILE *f = std::fopen(std::string(path).c_str(), "w"); f) {
+            std::fprintf(f, "retrogfx-tuning %d %u %d %zu %u %zu\n", VERSION, cores, int(t.kernel), t.band_rows,
+                         t.threads, t.parallel_rows);
+            std::fclose(f);
+        }
+    }
+
+    // best of a few runs, to filter out noise
+    double measure(auto &&f)
+    {
+        double best = 1e30;
+        for (int i = 0; i < 5; i++) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+            best = std::min(best, d.count());
+        }
+        return best;
+    }
+} // namespace tuning
+
+Tuning autotune(std::string_view cache_path)
+{
+    unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    if (!cache_path.empty()) {
+        if (auto cached = tuning::load(cache_path, cores); cached) {
+            set_tuning(*cached);
+            return *cached;
+        }
+    }
+
+    // synthetic 4 bpp tiles: random enough that nothing is predictable.
+    // smaller sizes use only the first rows of tiles
+    const std::size_t MAX_ROWS = 1024, ROW_BYTES = 32 * TILES_PER_ROW;
+    std::vector<u8> tiles(ROW_BYTES * MAX_ROWS);
+    uint32_t seed = 12345;
+    for (auto &b : tiles) {
+        seed = seed * 1103515245 + 12345;
+        b = seed >> 16;
+    }
+
+    // kernels are timed on both formats they handle, at 2 and 4 bpp, as
+    // which one wins may change with them
+    Tuning best = { RowKernel::SWAR, 16, cores, 64 };
+    double best_time = 1e30;
+    std::array<u8, TILE_WIDTH * TILE_HEIGHT> out;
+    auto kernel_data = std::span(tiles).first(ROW_BYTES * 128);
+    for (auto k : { RowKernel::Bits, RowKernel::Table, RowKernel::SWAR }) {
+        auto kernel = planar_rows::get(k);
+        double t = tuning::measure([&] {
+            for (auto format : { Format::Planar, Format::Interwined })
+                for (int bpp : { 2, 4 })
+                    for (std::size_t i = 0; i + bpp*8 <= kernel_data.size(); i += bpp*8)
+                        for (int y = 0; y < TILE_HEIGHT; y++)
+                            kernel(&kernel_data[i], bpp, format, y, &out[y*TILE_WIDTH]);
+        });
+        if (t < best_time) {
+            best_time = t;
+            best.kernel = k;
+        }
+    }
+
+    // bands are tuned on a large image with every core, then threads with
+    // those bands, trying every count as the best one needn't be a power of 2...
+    std::vector<u8> image(MAX_ROWS * ROW_SIZE * TILE_HEIGHT);
+    best_time = 1e30;
+    for (std::size_t rows : { 1, 4, 16, 64 }) {
+        set_tuning({ best.kernel, rows, cores, 0 });
+        double t = tuning::measure([&] { decode_image(tiles, 4, Format::Planar, image); });
+        if (t < best_time) {
+            best_time = t;
+            best.band_rows = rows;
+        }
+    }
+    best_time = 1e30;
+    for (unsigned threads = 1; threads <= cores; threads++) {
+        set_tuning({ best.kernel, best.band_rows, threads, 0 });
+        double t = tuning::measure([&] { decode_image(tiles, 4, Format::Planar, image); });
+        if (t < best_time) {
+            best_time = t;
+            best.threads = threads;
+        }
+    }
+
+    // ...then smaller and smaller ones show where threads stop paying off
+    best.parallel_rows = SIZE_MAX;
+    for (std::size_t rows = MAX_ROWS; rows >= 4; rows /= 4) {
+        auto data = std::span(tiles).first(rows * ROW_BYTES);
+        set_tuning({ best.kernel, best.band_rows, 1, 0 });
+        double serial = tuning::measure([&] { decode_image(data, 4, Format::Planar, image); });
+        set_tuning({ best.kernel, best.band_rows, best.threads, 0 });
+        double parallel = tuning::measure([&] { decode_image(data, 4, Format::Planar, image); });
+        if (parallel >= serial)
+            break;
+        best.parallel_rows = rows;
     }
+    set_tuning(best);
+    if (!cache_path.empty())
+        tuning::save(cache_path, cores, best);
+    return best;
 }
 
 long img_height(std::size_t num_bytes, int bpp)
@@ -248,7 +3174,7 @@ long img_height(std::size_t num_bytes, int bpp)
 void grayscale_palette(int bpp, std::function<void(u8)> f)
 {
     const unsigned n = bpp_size(bpp);
-    for (u8 t = 0; t < n; t++)
+    for (unsigned t = 0; t < n; t++)
         f(0xFF / (n-1) * t);
 }
 
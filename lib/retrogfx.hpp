@@ -5,11 +5,19 @@
 #include <cstddef>
 #include <cstdint>
 #include <cmath>
+#include <condition_variable>
+#include <coroutine>
 #include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
+#include <mutex>
 #include <optional>
 #include <span>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 namespace retrogfx {
 
@@ -40,6 +48,33 @@ enum class Format {
      *   Each byte encodes one pixel.
      */
     GBA,
+
+    /*
+     * PlayStation textures, as found in VRAM (see ps1_read_texture()).
+     * Unlike the formats above, there are no tiles: pixels are packed row
+     * after row, like a linear image. Bytes are laid out like on the GBA:
+     * at 4 BPP the lower 4 bits encode the pixel on the left, at 8 BPP each
+     * byte is one pixel.
+     */
+    PS1,
+
+    /*
+     * N64 CI4 and CI8 textures. Linear, like PS1, except that at 4 BPP
+     * the higher 4 bits encode the pixel on the left.
+     */
+    N64,
+
+    /*
+     * The Virtual Boy's format, 2 BPP only: each row of a tile is a little
+     * endian 16-bit word, with the pixel on the left in the lowest 2 bits.
+     */
+    VirtualBoy,
+
+    /*
+     * The Neo Geo Pocket's format, 2 BPP only: like VirtualBoy, except the
+     * pixel on the left is in the highest 2 bits of each word.
+     */
+    NGP,
 };
 
 inline std::optional<Format> string_to_format(std::string_view s)
@@ -47,6 +82,10 @@ inline std::optional<Format> string_to_format(std::string_view s)
     if (s == "planar")      return Format::Planar;
     if (s == "interwined")  return Format::Interwined;
     if (s == "gba")         return Format::GBA;
+    if (s == "ps1")         return Format::PS1;
+    if (s == "n64")         return Format::N64;
+    if (s == "vb")          return Format::VirtualBoy;
+    if (s == "ngp")         return Format::NGP;
     return std::nullopt;
 }
 
@@ -56,26 +95,71 @@ inline std::optional<std::string_view> format_to_string(Format f)
     case Format::Planar:     return "planar";
     case Format::Interwined: return "interwined";
     case Format::GBA:        return "gba";
+    case Format::PS1:        return "ps1";
+    case Format::N64:        return "n64";
+    case Format::VirtualBoy: return "vb";
+    case Format::NGP:        return "ngp";
     default:                 return std::nullopt;
     }
 }
 
+/*
+ * Whether @format can hold @bpp bits per pixel: GBA, PS1 and N64 take only
+ * 4 or 8, Virtual Boy and NGP only 2, the others anything from 1 to MAX_BPP.
+ * Passing a BPP the format can't hold to any other function is an error.
+ */
+inline bool format_supports_bpp(Format format, int bpp)
+{
+    switch (format) {
+    case Format::GBA: case Format::PS1: case Format::N64:
+        return bpp == 4 || bpp == 8;
+    case Format::VirtualBoy: case Format::NGP:
+        return bpp == 2;
+    default:
+        return bpp >= 1 && bpp <= MAX_BPP;
+    }
+}
+
 /*
  * Decodes a given array of bytes into an indexed image.
+ * Tiled formats give TILES_PER_ROW tiles on each row of the image, while
+ * linear formats (PS1, N64) are cut into rows of ROW_SIZE pixels.
  * @bytes are the bytes to decode.
  * @format describes the format of the bytes.
  * @bpp describes how many bits per pixel to use (most formats accept any
  * number of bits per pixel, some may not).
  * @draw_row is a callback function that will be called for each row of the
  * resulting image. It has as input an array of indexes.
+ * @max_threads caps the threads large inputs are decoded with (see
+ * decode_image()); 0 leaves it to the tuning, 1 keeps it all on the calling
+ * thread, e.g. when it's already one of many workers.
  */
 void decode(
     std::span<uint8_t> bytes,
     int bpp,
     Format format,
-    std::function<void(std::span<int>)> draw_row
+    std::function<void(std::span<int>)> draw_row,
+    unsigned max_threads = 0
 );
 
+/*
+ * Decodes the single tile @tile, bpp*8 bytes long, into @out, which must
+ * have room for TILE_WIDTH * TILE_HEIGHT indexes, one byte each, row after
+ * row. Linear formats (PS1, N64) take the same bytes as 64 pixels in a row.
+ */
+void decode_tile(std::span<const uint8_t> tile, int bpp, Format format, uint8_t *out);
+
+/*
+ * Decodes all of @bytes at once into @image, which must have room for
+ * ROW_SIZE * img_height() indexes: the same rows decode() would draw, one
+ * byte per pixel. Rows of tiles are split in bands, which are decoded in
+ * parallel; see autotune() for how big they are and how many threads are
+ * used, at most @max_threads if not 0. decode() and Decoder::push() go
+ * through here when given enough bytes at once.
+ */
+void decode_image(std::span<const uint8_t> bytes, int bpp, Format format, std::span<uint8_t> image,
+                  unsigned max_threads = 0);
+
 /*
  * Encodes a given array of bytes, formatted as an indexed image, to a given
  * format.
@@ -94,6 +178,675 @@ void encode(
     std::function<void(std::span<uint8_t>)> write_data
 );
 
+/*
+ * An incremental version of decode(), for when the bytes arrive a bit at a
+ * time (e.g. when reading from a pipe). @draw_row is called as soon as a full
+ * row of tiles has been pushed.
+ */
+class Decoder {
+    int bpp;
+    Format format;
+    std::function<void(std::span<int>)> draw_row;
+    unsigned max_threads;
+    std::vector<uint8_t> pending;
+
+public:
+    /* See decode() for @max_threads. */
+    Decoder(int bpp, Format format, std::function<void(std::span<int>)> draw_row, unsigned max_threads = 0);
+
+    /*
+     * Decodes @bytes, keeping any incomplete row of tiles for later. Large
+     * pushes are decoded in parallel (see decode_image()).
+     */
+    void push(std::span<const uint8_t> bytes);
+
+    /* Decodes what's left, with any missing tiles left blank. */
+    void finish();
+};
+
+/*
+ * An incremental version of encode(), for when the height of the image isn't
+ * known up front. Rows are pushed one at a time and @write_data is called as
+ * soon as a full row of tiles is available.
+ * @width must be a multiple of 8.
+ */
+class Encoder {
+    std::size_t width;
+    int bpp;
+    Format format;
+    std::function<void(std::span<uint8_t>)> write_data;
+    std::vector<uint8_t> rows, band;
+    std::size_t num_rows = 0;
+
+    void encode_band();
+
+public:
+    Encoder(std::size_t width, int bpp, Format format,
+            std::function<void(std::span<uint8_t>)> write_data);
+
+    /* Adds one row of indexes, @width long. */
+    void push_row(std::span<const uint8_t> row);
+
+    /* Encodes the last rows, padding them with index 0 up to a multiple of 8. */
+    void finish();
+};
+
+/*
+ * Decodes tiles that don't start on byte boundaries, as found in games that
+ * pack tiles (often 3 BPP or 1 BPP ones) back to back in a stream of bits.
+ * Tile n starts at bit @bit_offset + n * @bit_stride of @bytes, bits being
+ * counted from the most significant one of each byte, and is bpp*64 bits
+ * long, so @bit_stride must be at least that. For linear formats, each
+ * bpp*64 bits are taken as a tile would be. As many whole tiles as @bytes
+ * holds are decoded, drawing rows like decode() would.
+ */
+void decode_bits(
+    std::span<const uint8_t> bytes,
+    std::size_t bit_offset,
+    std::size_t bit_stride,
+    int bpp,
+    Format format,
+    std::function<void(std::span<int>)> draw_row
+);
+
+/*
+ * The part of decode_bits() that takes tiles out of the stream of bits:
+ * @output is called with runs of whole tiles, aligned to bytes, which can
+ * then be pushed to a Decoder.
+ */
+void gather_bits(
+    std::span<const uint8_t> bytes,
+    std::size_t bit_offset,
+    std::size_t bit_stride,
+    int bpp,
+    std::function<void(std::span<const uint8_t>)> output
+);
+
+/*
+ * The opposite of decode_bits(): encodes the indexed image @indices (like
+ * encode() does) and writes tile n at bit @bit_offset + n * @bit_stride of
+ * @bytes. Bits of @bytes that no tile covers are left as they are.
+ * Returns the number of tiles written; tiles that don't fit in @bytes are
+ * dropped.
+ */
+std::size_t encode_bits(
+    std::span<const uint8_t> indices,
+    std::size_t width,
+    std::size_t height,
+    int bpp,
+    Format format,
+    std::span<uint8_t> bytes,
+    std::size_t bit_offset,
+    std::size_t bit_stride
+);
+
+/* The result of a job run by a JobPool. */
+struct JobResult {
+    /*
+     * false if the job never ran, because the pool was full or because its
+     * arguments were invalid (see @error).
+     */
+    bool ok = false;
+    /* Why the job failed, if it did; empty for a full pool. */
+    std::string error;
+    /*
+     * For decoding, the indexed image, one byte per pixel, @width * @height
+     * bytes (the same rows decode() gives). For encoding, the tiles.
+     */
+    std::vector<uint8_t> data;
+    std::size_t width = 0, height = 0;
+};
+
+/*
+ * Runs decode() and encode() jobs on worker threads, for programs that
+ * can't block on them (e.g. servers built around an event loop).
+ * The pool accepts only so many pending jobs: past that, submitting fails
+ * right away instead of queueing, so that the time a job waits stays
+ * bounded and the caller can shed load.
+ * Completion can be received through a callback, a std::future, or by
+ * co_await'ing decode_async()/encode_async() inside a coroutine. Callbacks
+ * and coroutines resume on a worker thread: an event loop will usually want
+ * to hand the result back to its own thread (e.g. by writing to an eventfd
+ * or a pipe from the callback).
+ */
+class JobPool {
+public:
+    using Callback = std::function<void(JobResult)>;
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::size_t max_pending, num_pending = 0;
+    bool stopping = false;
+
+    bool push(std::function<void()> job);
+    void work();
+
+public:
+    /*
+     * Waits for a job to complete when co_await'ed. If the pool is full,
+     * the coroutine isn't suspended at all and the result has ok = false.
+     */
+    class Awaiter {
+        std::function<bool(Callback)> submit;
+        JobResult result;
+
+    public:
+        explicit Awaiter(std::function<bool(Callback)> submit) : submit(std::move(submit)) { }
+
+        bool await_ready() const { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            // the job may complete (and destroy this awaiter) before
+            // submit() even returns, so nothing of this must be touched after
+            auto f = std::move(submit);
+            return f([this, handle](JobResult r) {
+                result = std::move(r);
+                handle.resume();
+            });
+        }
+
+        JobResult await_resume() { return std::move(result); }
+    };
+
+    /*
+     * Starts @num_threads worker threads (0 means one for each core).
+     * @max_pending is how many jobs can be queued or running at once.
+     */
+    explicit JobPool(std::size_t num_threads = 0, std::size_t max_pending = 64);
+
+    /* Completes every job already submitted, then stops the workers. */
+    ~JobPool();
+
+    JobPool(const JobPool &) = delete;
+    JobPool &operator=(const JobPool &) = delete;
+
+    /* How many jobs are queued or running. */
+    std::size_t pending() const;
+
+    /*
+     * Submits a decode() of @bytes; see decode() for the other arguments.
+     * @done is called with the result once the job is complete.
+     * Returns false if the pool is full, in which case @done is never
+     * called. Arguments are checked first, as they may come from untrusted
+     * requests: jobs with invalid ones complete right away with ok = false
+     * and an error, instead of asserting, and so do jobs that throw.
+     * Each job is decoded on its worker alone, without threads of its own.
+     */
+    bool submit_decode(std::vector<uint8_t> bytes, int bpp, Format format, Callback done);
+
+    /*
+     * Submits an encode() of @indices; see encode() for the other arguments.
+     * The rest works as in submit_decode().
+     */
+    bool submit_encode(std::vector<uint8_t> indices, std::size_t width, std::size_t height,
+                       int bpp, Format format, Callback done);
+
+    /* Like submit_decode(), but returns a future, or std::nullopt if the pool is full. */
+    std::optional<std::future<JobResult>> decode_future(std::vector<uint8_t> bytes, int bpp, Format format);
+
+    /* Like submit_encode(), but returns a future, or std::nullopt if the pool is full. */
+    std::optional<std::future<JobResult>> encode_future(std::vector<uint8_t> indices,
+        std::size_t width, std::size_t height, int bpp, Format format);
+
+    /* Like submit_decode(), but for co_await. */
+    Awaiter decode_async(std::vector<uint8_t> bytes, int bpp, Format format);
+
+    /* Like submit_encode(), but for co_await. */
+    Awaiter encode_async(std::vector<uint8_t> indices, std::size_t width, std::size_t height,
+                         int bpp, Format format);
+};
+
+/* Ways to decode rows of Planar and Interwined tiles. */
+enum class RowKernel {
+    Bits,   // one bit at a time
+    Table,  // a lookup table that spreads the 8 bits of a byte to 8 bytes
+    SWAR,   // the same, with a multiplication and some masks
+};
+
+/* Parameters that change how fast decoding is, but not its result. */
+struct Tuning {
+    RowKernel kernel;
+    /* How many rows of tiles each thread decodes at a time in decode_image(). */
+    std::size_t band_rows;
+    /* Threads used by decode_image(); 0 means one for each core. */
+    unsigned threads;
+    /*
+     * Fewer rows of tiles than this are decoded on a single thread, as
+     * starting threads would cost more than it saves.
+     */
+    std::size_t parallel_rows;
+};
+
+Tuning get_tuning();
+void set_tuning(const Tuning &tuning);
+
+/*
+ * Which tuning is fastest depends on the machine and on how much data is
+ * decoded at once. This benchmarks every kernel (on Planar and Interwined
+ * tiles of 2 and 4 BPP), a few band sizes, every thread count up to the
+ * number of cores and from which size threads start paying off, on
+ * synthetic tiles (taking a few tens of milliseconds), then uses the
+ * fastest ones from now on. Without autotuning, the SWAR kernel, bands of
+ * 16 rows, one thread for each core and threads from 64 rows of tiles on
+ * are used.
+ * If @cache_path isn't empty, results are stored there and later calls read
+ * them back instead of benchmarking again. The cache is discarded if the
+ * number of cores changes.
+ * Returns the tuning now in use.
+ */
+Tuning autotune(std::string_view cache_path = "");
+
+/* The size of the PlayStation's VRAM, in 16-bit words (i.e. 1 MB). */
+const int PS1_VRAM_WIDTH  = 1024;
+const int PS1_VRAM_HEIGHT = 512;
+
+/*
+ * Reads the indexes of a texture from a dump of the PlayStation's VRAM.
+ * @vram is the dump, at least 1 MB (little endian 16-bit words).
+ * @page is the texture page (0-31) as used by the GPU: pages are 64 words
+ * wide and 256 lines tall, with 16 pages on each row.
+ * @u and @v are the coordinates of the texture inside the page, in pixels.
+ * The texture may extend past the page's right edge, into the next pages, so
+ * a whole VRAM dump can be read in one go with page = 0, width =
+ * PS1_VRAM_WIDTH * 16 / bpp and height = PS1_VRAM_HEIGHT.
+ * @bpp must be 4 or 8.
+ * @indices must have room for @width * @height indexes.
+ */
+void ps1_read_texture(
+    std::span<const uint8_t> vram,
+    int page,
+    std::size_t u,
+    std::size_t v,
+    std::size_t width,
+    std::size_t height,
+    int bpp,
+    std::span<uint8_t> indices
+);
+
+/*
+ * Reads a CLUT (color lookup table) from a dump of the PlayStation's VRAM,
+ * converting its colors from 15-bit BGR to RGBA.
+ * @x (in units of 16 words, 0-63) and @y (0-511) are the CLUT's position, as
+ * used by the GPU.
+ * @bpp must be 4 or 8, giving 16 or 256 colors.
+ * Returns the colors, 4 bytes each. Color 0x0000 is transparent on the
+ * PlayStation, so it gets an alpha of 0.
+ */
+std::vector<std::vector<uint8_t>> ps1_read_clut(
+    std::span<const uint8_t> vram,
+    int x,
+    int y,
+    int bpp
+);
+
+/*
+ * Converts a linear indexed image (one byte per pixel) into tile-major order,
+ * where the pixels of each tile are stored one after the other, row after row,
+ * and tiles follow each other from left to right, top to bottom.
+ * @src is the linear image, of size @width * @height, with rows @pitch bytes
+ * apart.
+ * @dst is where tiles are written. It must have room for @width * @height
+ * pixels.
+ * @width and @height must be multiples of @tile_width and @tile_height.
+ */
+void swizzle(
+    std::span<const uint8_t> src,
+    std::span<uint8_t> dst,
+    std::size_t width,
+    std::size_t height,
+    std::size_t pitch,
+    int tile_width = TILE_WIDTH,
+    int tile_height = TILE_HEIGHT
+);
+
+/*
+ * The reverse of swizzle(): @src is in tile-major order, while @dst is a
+ * linear image with rows @pitch bytes apart.
+ */
+void deswizzle(
+    std::span<const uint8_t> src,
+    std::span<uint8_t> dst,
+    std::size_t width,
+    std::size_t height,
+    std::size_t pitch,
+    int tile_width = TILE_WIDTH,
+    int tile_height = TILE_HEIGHT
+);
+
+/*
+ * The following functions transform encoded tiles in place, without
+ * decoding them first.
+ * @tiles are the bytes of one or more encoded tiles (every tile is bpp*8
+ * bytes long).
+ * @bpp and @format describe how the tiles are encoded.
+ */
+
+/* Mirrors each tile horizontally. */
+void flip_tiles_h(std::span<uint8_t> tiles, int bpp, Format format);
+
+/* Mirrors each tile vertically. */
+void flip_tiles_v(std::span<uint8_t> tiles, int bpp, Format format);
+
+/* Rotates each tile by 180 degrees (that is, both flips at once). */
+void rotate_tiles_180(std::span<uint8_t> tiles, int bpp, Format format);
+
+/*
+ * Replaces each pixel's index with the one found in @map, which must have
+ * at least 2^bpp entries (i.e. index i becomes map[i]). Values in @map are
+ * truncated to @bpp bits.
+ */
+void remap_tiles(std::span<uint8_t> tiles, int bpp, Format format,
+                 std::span<const uint8_t> map);
+
+/*
+ * The following functions read and write pixels directly on an encoded tile,
+ * touching only the bits of the pixels involved.
+ * @tile is the data of a single encoded tile.
+ * @x and @y are the coordinates of the pixel inside the tile (0-7).
+ * @bpp and @format describe how the tile is encoded.
+ */
+
+/* Returns the index of the pixel at @x, @y. */
+int get_pixel(std::span<const uint8_t> tile, int x, int y, int bpp, Format format);
+
+/* Sets the pixel at @x, @y to @index. */
+void set_pixel(std::span<uint8_t> tile, int x, int y, int index, int bpp, Format format);
+
+/*
+ * Sets every pixel inside the rectangle starting at @x, @y of size @width *
+ * @height to @index. The rectangle is clipped to the tile's boundaries.
+ */
+void fill_rect(std::span<uint8_t> tile, int x, int y, int width, int height,
+               int index, int bpp, Format format);
+
+/*
+ * A pixel write for set_pixels(). @x and @y are coordinates inside the image
+ * produced by decode() (i.e. with TILES_PER_ROW tiles on each row).
+ */
+struct PixelWrite {
+    std::size_t x, y;
+    uint8_t index;
+};
+
+/*
+ * Applies a batch of @writes on @tiles, which are the bytes of an encoded
+ * image. Writes falling outside of @tiles are ignored.
+ */
+void set_pixels(std::span<uint8_t> tiles, std::span<const PixelWrite> writes,
+                int bpp, Format format);
+
+/*
+ * Returns a 64-bit fingerprint of @tile, suitable for deduplication, search
+ * and caching. @tile can be any multiple of 8 bytes long: in practice either
+ * an encoded tile (16, 32 or 64 bytes) or a decoded tile (64 indexes, one
+ * byte each). Fingerprints depend on the host's byte order.
+ */
+uint64_t hash_tile(std::span<const uint8_t> tile);
+
+/*
+ * Hashes every tile of size @tile_size found in @tiles and writes the
+ * fingerprints in @hashes, which must have room for all of them.
+ */
+void hash_tiles(std::span<const uint8_t> tiles, std::size_t tile_size,
+                std::span<uint64_t> hashes);
+
+/*
+ * Like hash_tile(), but the fingerprint is the same for a tile and its
+ * horizontally, vertically and doubly flipped versions.
+ * @tile is an encoded tile; @bpp and @format describe its encoding.
+ * Decoded tiles are laid out exactly like 8 bpp GBA tiles, so those can be
+ * hashed by passing 8 and Format::GBA.
+ */
+uint64_t hash_tile_canonical(std::span<const uint8_t> tile, int bpp, Format format);
+
+/* The batch version of hash_tile_canonical(), with one hash per tile. */
+void hash_tiles_canonical(std::span<const uint8_t> tiles, int bpp, Format format,
+                          std::span<uint64_t> hashes);
+
+/*
+ * Returns the number of pixels that differ between the encoded tiles @a and
+ * @b, both encoded with @bpp and @format.
+ */
+int tile_distance(std::span<const uint8_t> a, std::span<const uint8_t> b,
+                  int bpp, Format format);
+
+/* A match found by find_similar_tiles(). */
+struct TileMatch {
+    std::size_t tile;
+    int distance;
+};
+
+/*
+ * Finds near-duplicate tiles. For each tile inside @tiles, up to
+ * @max_matches other tiles that differ from it by at most @max_distance
+ * pixels are found (see tile_distance()). The result has one list of
+ * matches for each tile, sorted by distance and then by tile number.
+ * Small distances are looked up through buckets of identical tile sections,
+ * so large tilesets don't need to compare every pair of tiles.
+ */
+std::vector<std::vector<TileMatch>> find_similar_tiles(
+    std::span<const uint8_t> tiles,
+    int bpp,
+    Format format,
+    int max_distance,
+    std::size_t max_matches
+);
+
+/* The result of reduce_tiles(). */
+struct ReducedTiles {
+    /* The encoded tiles that were kept. */
+    std::vector<uint8_t> tiles;
+    /* For each input tile, the index of the tile replacing it. */
+    std::vector<std::size_t> tilemap;
+    /* For each input tile, how many pixels differ from its replacement. */
+    std::vector<int> errors;
+    std::size_t total_error = 0;
+    int max_error = 0;
+};
+
+/*
+ * Reduces the number of unique tiles inside @tiles to at most @max_tiles.
+ * Identical tiles are merged first; if that isn't enough, near-duplicate
+ * tiles are clustered together (k-medoids, using tile_distance() weighted by
+ * how many times each tile appears) and each cluster is replaced by its
+ * medoid.
+ * @bpp and @format describe how the tiles are encoded.
+ */
+ReducedTiles reduce_tiles(
+    std::span<const uint8_t> tiles,
+    int bpp,
+    Format format,
+    std::size_t max_tiles
+);
+
+/* A decoded tile, along with a mask of its non-transparent pixels. */
+struct DecodedTile {
+    /* The tile's indexes, row after row. */
+    std::array<uint8_t, TILE_WIDTH * TILE_HEIGHT> pixels;
+    /* Bit y*8+x is set when the pixel at x, y isn't 0. */
+    uint64_t opaque;
+};
+
+/*
+ * Decodes tiles on demand and keeps them around, for when the same tiles
+ * get drawn over and over.
+ * @tiles are the encoded tiles, which must outlive the cache.
+ * @bpp and @format describe how they are encoded.
+ */
+class TileCache {
+    std::span<const uint8_t> tiles;
+    int tile_bpp;
+    Format tile_format;
+    std::vector<DecodedTile> decoded;
+    std::vector<bool> valid;
+
+public:
+    TileCache(std::span<const uint8_t> tiles, int bpp, Format format);
+
+    /* Returns tile number @n, decoding it if needed. @n must be < size(). */
+    const DecodedTile &get(std::size_t n);
+
+    /* Decodes all tiles, so that get() won't modify the cache anymore. */
+    void load_all();
+
+    std::size_t size() const { return decoded.size(); }
+    int bpp() const { return tile_bpp; }
+    Format format() const { return tile_format; }
+};
+
+/*
+ * Packs indexes with at most 16 colors (e.g. decoded from 1-4 bpp tiles) two
+ * per byte, halving their size. The first index of each pair goes in the low
+ * nibble, like in 4 bpp GBA tiles.
+ * @indices are the indexes, one byte each. Its size must be even.
+ * @packed must have room for indices.size() / 2 bytes.
+ */
+void pack_nibbles(std::span<const uint8_t> indices, std::span<uint8_t> packed);
+
+/*
+ * The reverse of pack_nibbles().
+ * @indices must have room for packed.size() * 2 bytes.
+ */
+void unpack_nibbles(std::span<const uint8_t> packed, std::span<uint8_t> indices);
+
+/* Returns index number @i of the nibble-packed indexes @packed. */
+inline int get_nibble(std::span<const uint8_t> packed, std::size_t i)
+{
+    return packed[i/2] >> (i%2 * 4) & 0xF;
+}
+
+/* Like DecodedTile, but with the indexes nibble-packed. Only for bpp <= 4. */
+struct PackedTile {
+    /* The tile's indexes, row after row, 4 bytes per row. */
+    std::array<uint8_t, TILE_WIDTH * TILE_HEIGHT / 2> pixels;
+    /* Bit y*8+x is set when the pixel at x, y isn't 0. */
+    uint64_t opaque;
+};
+
+/* Unpacks a PackedTile into a DecodedTile. */
+DecodedTile unpack_tile(const PackedTile &tile);
+
+/*
+ * Like TileCache, but keeps tiles nibble-packed, so that it uses about half
+ * the memory. @bpp must be at most 4.
+ */
+class PackedTileCache {
+    std::span<const uint8_t> tiles;
+    int tile_bpp;
+    Format tile_format;
+    std::vector<PackedTile> decoded;
+    std::vector<bool> valid;
+
+public:
+    PackedTileCache(std::span<const uint8_t> tiles, int bpp, Format format);
+
+    /* Returns tile number @n, decoding it if needed. @n must be < size(). */
+    const PackedTile &get(std::size_t n);
+
+    /* Decodes all tiles, so that get() won't modify the cache anymore. */
+    void load_all();
+
+    std::size_t size() const { return decoded.size(); }
+    int bpp() const { return tile_bpp; }
+    Format format() const { return tile_format; }
+};
+
+/* How many tiles a sprite uses. */
+enum class SpriteSize {
+    /* A single tile. */
+    Size8x8,
+    /* Two tiles, @tile on top and @tile+1 below (like the NES). */
+    Size8x16,
+    /*
+     * Four tiles, taken from a 2x2 area of the image produced by decode():
+     * @tile, @tile+1, @tile+TILES_PER_ROW and @tile+TILES_PER_ROW+1 (like the
+     * SNES).
+     */
+    Size16x16,
+};
+
+/* An OAM-style sprite entry. */
+struct Sprite {
+    std::size_t tile;
+    int x, y;
+    bool hflip = false;
+    bool vflip = false;
+    int palette = 0;
+    /* Sprites with lower priority are drawn on top. */
+    int priority = 0;
+    SpriteSize size = SpriteSize::Size8x8;
+};
+
+/*
+ * Draws @sprites on @frame, which is an indexed image of size @width *
+ * @height. Each drawn pixel becomes palette * 2^bpp + index; transparent
+ * pixels (index 0) leave @frame untouched. Between sprites with the same
+ * priority, the ones coming first in @sprites are drawn on top.
+ * @cache holds the sprites' tiles.
+ */
+void render_sprites(
+    TileCache &cache,
+    std::span<const Sprite> sprites,
+    std::span<uint8_t> frame,
+    std::size_t width,
+    std::size_t height
+);
+
+/*
+ * The batch version of render_sprites(): draws each list of sprites inside
+ * @frames on its own frame. @output holds all frames one after the other,
+ * each one of size @width * @height. Frames are drawn in parallel.
+ */
+void render_frames(
+    TileCache &cache,
+    std::span<const std::span<const Sprite>> frames,
+    std::span<uint8_t> output,
+    std::size_t width,
+    std::size_t height
+);
+
+/* A background tilemap entry. */
+struct MapEntry {
+    std::size_t tile;
+    bool hflip = false;
+    bool vflip = false;
+    int palette = 0;
+};
+
+/* Parameters that can change on every line drawn by render_background(). */
+struct ScanlineParams {
+    int scroll_x = 0;
+    int scroll_y = 0;
+    /* Added to the palette of every tile drawn on this line. */
+    int palette_bank = 0;
+};
+
+/*
+ * Draws a background on @frame, which is an indexed image of size @width *
+ * @height, one line at a time, like a console would (HDMA-style effects
+ * included). Each pixel becomes palette * 2^bpp + index.
+ * @cache holds the background's tiles.
+ * @map is the tilemap, made of @map_width * @map_height entries in row-major
+ * order. The background wraps around at its edges.
+ * @lines holds the parameters used for each line of @frame; lines past its
+ * end reuse its last entry. Lines of the background are rendered once and
+ * reused, so that effects cost as much as a static background.
+ */
+void render_background(
+    TileCache &cache,
+    std::span<const MapEntry> map,
+    std::size_t map_width,
+    std::size_t map_height,
+    std::span<const ScanlineParams> lines,
+    std::span<uint8_t> frame,
+    std::size_t width,
+    std::size_t height
+);
+
 /* Finds @color in @palette. Returns the index or -1 if not found. */
 template <typename T>
 int find_color(std::span<T> palette, std::span<uint8_t> color)
@@ -156,6 +909,218 @@ void apply_palette(
         output(palette[i]);
 }
 
+/*
+ * Like apply_palette(), but @data are nibble-packed indexes (see
+ * pack_nibbles()). @output is called twice for each byte.
+ */
+template <typename T>
+void apply_palette_packed(
+    std::span<const uint8_t> data,
+    std::span<T> palette,
+    std::function<void(T)> output
+)
+{
+    for (auto b : data) {
+        output(palette[b & 0xF]);
+        output(palette[b >> 4]);
+    }
+}
+
+/*
+ * Builds a palette suitable for @data, for when the image's exact palette
+ * isn't known beforehand (e.g. truecolor art). Colors are first counted in a
+ * histogram, which is then split with median cut and refined with a few
+ * rounds of k-means. Images with no more than @num_colors colors get
+ * exactly their own colors, in the order they first appear.
+ * @data is the data of the image, with @channels components per color.
+ * @num_colors is the maximum number of colors (usually bpp_size(bpp)).
+ * Returns the colors, each one @channels bytes long.
+ */
+std::vector<std::vector<uint8_t>> make_palette(
+    std::span<const uint8_t> data,
+    int channels,
+    int num_colors
+);
+
+/*
+ * Like make_indexed(), but instead of requiring an exact match, each pixel
+ * gets the index of the nearest color inside @palette.
+ * @indices must have room for one index per pixel.
+ */
+void make_indexed_nearest(
+    std::span<const uint8_t> data,
+    std::span<const std::vector<uint8_t>> palette,
+    int channels,
+    std::span<uint8_t> indices
+);
+
+/* The result of make_nes_background(). */
+struct NesBackground {
+    /* Every color found in the image, each one is @channels bytes long. */
+    std::vector<std::vector<uint8_t>> colors;
+    /*
+     * The sub-palettes, as indexes into colors. Entry 0 is the background
+     * color, shared by all sub-palettes; unused entries repeat it.
+     */
+    std::vector<std::array<uint8_t, 4>> palettes;
+    /* The unique tiles, encoded as 2 bpp Planar. */
+    std::vector<uint8_t> chr;
+    /* For each 8x8 area, in row-major order, the tile number in chr. */
+    std::vector<uint8_t> nametable;
+    /*
+     * For each 32x32 area, in row-major order, which sub-palette each of its
+     * 16x16 cells uses: bits 0-1 for the top left cell, 2-3 top right,
+     * 4-5 bottom left and 6-7 bottom right.
+     */
+    std::vector<uint8_t> attributes;
+};
+
+/*
+ * Converts a truecolor image into a NES background, where each 16x16 cell
+ * picks one of up to 4 sub-palettes of 3 colors plus a shared background
+ * color. Sub-palettes are chosen so that every cell fits in one.
+ * @data is the data of the image, with @channels components per color.
+ * @width and @height must be multiples of 16.
+ * @num_palettes is how many sub-palettes can be used (1-4).
+ * Returns std::nullopt if the image has more than 64 colors, if a cell has
+ * more than 4 colors, if the cells can't be fit in @num_palettes
+ * sub-palettes or if the image has more than 256 unique tiles.
+ */
+std::optional<NesBackground> make_nes_background(
+    std::span<const uint8_t> data,
+    std::size_t width,
+    std::size_t height,
+    int channels,
+    int num_palettes = 4
+);
+
+/*
+ * A lossless codec made for tile data, for when tiles need to be stored
+ * for a long time. Tiles are split into bit planes and each row of a plane
+ * is XORed with the one above it; tiles equal to a recent one become a
+ * reference to it. All of this is then entropy coded with rANS, one stream
+ * per plane. Tiles are compressed in independent blocks, on multiple
+ * threads.
+ * @tiles are the encoded tiles; @bpp and @format describe their encoding.
+ * Returns the compressed data, which records @bpp and @format too.
+ */
+std::vector<uint8_t> compress_tiles(std::span<const uint8_t> tiles, int bpp, Format format);
+
+/* What compressed data holds. */
+struct CompressedTiles {
+    int bpp;
+    Format format;
+    std::size_t num_tiles;
+};
+
+/* Returns what @data holds, or std::nullopt if it isn't compressed tile data. */
+std::optional<CompressedTiles> compressed_tiles_info(std::span<const uint8_t> data);
+
+/*
+ * Decompresses @data, as returned by compress_tiles().
+ * Tiles are passed to @write_data one block at a time, in their original
+ * format, so that they can go straight to a Decoder or to decode().
+ * Returns false if @data is corrupt, which can happen after some blocks
+ * were already written.
+ */
+bool decompress_tiles(std::span<const uint8_t> data, std::function<void(std::span<uint8_t>)> write_data);
+
+/*
+ * retrogfx containers store tiles along with what's needed to read them back:
+ * format, bpp and palette. Identical tiles are stored only once, and an index
+ * maps every tile to its data, so any tile can be found in constant time.
+ * Tiles are grouped in blocks, each one optionally compressed with RLE
+ * (PackBits) or with compress_tiles(). Blocks stored as they are can be read in place, so a
+ * container can be mmapped and its tiles passed to decode() and the other
+ * functions without copying anything.
+ */
+
+enum class Compression {
+    None,
+    RLE,
+    Tiles,
+};
+
+/*
+ * Builds a container.
+ * @tiles are the encoded tiles; @bpp and @format describe their encoding.
+ * @palette holds the colors, @channels bytes each. It may be empty.
+ * @compression is how blocks are compressed. Blocks that don't get any
+ * smaller are stored as they are anyway.
+ * Returns the contents of the container.
+ */
+std::vector<uint8_t> write_container(
+    std::span<const uint8_t> tiles,
+    int bpp,
+    Format format,
+    std::span<const uint8_t> palette,
+    int channels,
+    Compression compression
+);
+
+/* A read-only view of a container. Use read_container() to get one. */
+class Container {
+    std::span<const uint8_t> file;
+    int tile_bpp = 0;
+    Format tile_format = Format::Planar;
+    int num_channels = 0;
+    uint8_t flags = 0;
+    std::size_t num_colors = 0, num_tiles = 0, num_unique = 0;
+    std::size_t tiles_per_block = 0, num_blocks = 0;
+    std::size_t palette_offset = 0, index_offset = 0, table_offset = 0;
+
+    friend std::optional<Container> read_container(std::span<const uint8_t> file);
+
+public:
+    int bpp() const { return tile_bpp; }
+    Format format() const { return tile_format; }
+    int channels() const { return num_channels; }
+
+    /* The palette's colors, channels() bytes each. Points inside the container. */
+    std::span<const uint8_t> palette() const
+    {
+        return file.subspan(palette_offset, num_colors * num_channels);
+    }
+
+    /* How many tiles the index has. */
+    std::size_t size() const { return num_tiles; }
+
+    /* How many different tiles are stored. */
+    std::size_t unique_tiles() const { return num_unique; }
+
+    /* Returns which stored tile tile number @n uses. @n must be < size(). */
+    std::size_t unique_index(std::size_t n) const;
+
+    /* How many bytes a block holds when decompressed. */
+    std::size_t block_size() const { return tiles_per_block * tile_bpp * 8; }
+
+    std::size_t blocks() const { return num_blocks; }
+
+    /*
+     * Returns the stored tiles of block @b. If the block isn't compressed,
+     * the result points inside the container; otherwise it's decompressed
+     * into @buf, which must have room for block_size() bytes. Returns an
+     * empty span if the block's data is corrupt.
+     */
+    std::span<const uint8_t> block(std::size_t b, std::span<uint8_t> buf) const;
+
+    /*
+     * Returns tile number @n, following the index, with the same rules as
+     * block(). @n must be < size().
+     */
+    std::span<const uint8_t> tile(std::size_t n, std::span<uint8_t> buf) const;
+
+    /* Returns all tiles in index order, ready to be passed to decode(). */
+    std::vector<uint8_t> tiles() const;
+};
+
+/*
+ * Checks that @file is a valid container and returns a view of it. @file
+ * must outlive the view. Returns std::nullopt if @file isn't a container or
+ * if it's truncated or corrupt.
+ */
+std::optional<Container> read_container(std::span<const uint8_t> file);
+
 /*
  * A helper function to calculate the height of the resulting image when
  * decoding. Before allocating space for an image, this function should be
@@ -166,7 +1131,7 @@ void apply_palette(
 long img_height(std::size_t num_bytes, int bpp);
 
 /* A helper function that returns the size for a palette of @bpp color depth. */
-constexpr inline int bpp_size(int bpp) { return std::pow(bpp, 2); }
+constexpr inline int bpp_size(int bpp) { return 1 << bpp; }
 
 /*
  * Helper functions that returns a grayscale palette for use when decoding.
@@ -0,0 +1,23 @@
+// checks that compressed tile data with a header that doesn't make sense
+// is rejected rather than decoded
+#include <cstdint>
+#include <vector>
+#include <fmt/core.h>
+#include "retrogfx.hpp"
+
+int main(int argc, char *argv[])
+{
+    int test_num = argc > 1 ? std::atoi(argv[1]) : 0;
+    std::vector<uint8_t> tiles(16 * 64);
+    for (std::size_t i = 0; i < tiles.size(); i++)
+        tiles[i] = i * 7;
+    auto data = retrogfx::compress_tiles(tiles, 2, retrogfx::Format::Planar);
+    // GBA tiles can't have 2 bpp
+    data[5] = uint8_t(retrogfx::Format::GBA);
+    bool called = false;
+    bool ok = !retrogfx::compressed_tiles_info(data)
+           && !retrogfx::decompress_tiles(data, [&](std::span<uint8_t>) { called = true; })
+           && !called;
+    fmt::print("test {} {}\n", test_num, ok ? "passed" : "failed");
+    return ok ? 0 : 1;
+}
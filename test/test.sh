@@ -32,8 +32,133 @@ test_file_reverse() {
     rm "$file.2.png"
 }
 
+test_pipe() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    if [[ $(cat "$file.bin" | ./converter - -o - -b $bpp -f $format \
+          | ./converter -r - -o - -b $bpp -f $format | diff "$file.bin" -) ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+}
+
+test_container() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    ./converter "$file.bin" -o "$file.png" -b $bpp -f $format
+    ./converter -r "$file.png" -o "$file.rgfx" -b $bpp -f $format
+    ./converter "$file.rgfx" -o "$file.2.png"
+    if [[ $(diff "$file.png" "$file.2.png") ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.png" "$file.rgfx" "$file.2.png"
+}
+
+test_qoi() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    ./converter "$file.bin" -o "$file.qoi" -b $bpp -f $format
+    ./converter -r "$file.qoi" -o "$file.2.bin" -b $bpp -f $format
+    if [[ $(diff "$file.bin" "$file.2.bin") ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.qoi" "$file.2.bin"
+}
+
+test_bits() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    ./converter "$file.bin" -o "$file.png" -b $bpp -f $format
+    ./converter "$file.bin" -o "$file.2.png" -b $bpp -f $format -s 0,$((bpp*64))
+    if [[ $(diff "$file.png" "$file.2.png") ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.png" "$file.2.png"
+}
+
+test_bits_shifted() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    shift=$5
+    # the same tiles, starting @shift bits into the file
+    python3 -c 'import sys; d = open(sys.argv[1], "rb").read(); n = int.from_bytes(d, "big") << (8 - int(sys.argv[3]))
+open(sys.argv[2], "wb").write(n.to_bytes(len(d) + 1, "big"))' "$file.bin" "$file.shifted.bin" $shift
+    ./converter "$file.bin" -o "$file.png" -b $bpp -f $format
+    ./converter "$file.shifted.bin" -o "$file.2.png" -b $bpp -f $format -s $shift
+    ./converter -r "$file.png" -o "$file.2.bin" -b $bpp -f $format -s $shift
+    if [[ $(diff "$file.png" "$file.2.png") || $(cmp "$file.shifted.bin" "$file.2.bin" 2>&1) ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.shifted.bin" "$file.png" "$file.2.png" "$file.2.bin"
+}
+
+test_zip() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    zip -q "$file.zip" "$file.bin"
+    ./converter "$file.zip:$file.bin" -o "$file.png" -b $bpp -f $format
+    ./converter -r "$file.png" -o "$file.2.bin" -b $bpp -f $format
+    if [[ $(diff "$file.bin" "$file.2.bin") ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.zip" "$file.png" "$file.2.bin"
+}
+
+test_romset() {
+    test_num=$1
+    file=$2
+    bpp=$3
+    format=$4
+    # split the file like two chips holding every other byte
+    xxd -p -c1 "$file.bin" | sed -n '1~2p' | xxd -r -p > "$file.even"
+    xxd -p -c1 "$file.bin" | sed -n '2~2p' | xxd -r -p > "$file.odd"
+    ./converter -i byte "$file.even" "$file.odd" -o "$file.png" -b $bpp -f $format
+    ./converter -r "$file.png" -o "$file.2.bin" -b $bpp -f $format
+    if [[ $(diff "$file.bin" "$file.2.bin") ]]; then
+        echo "test" $test_num "failed"
+    else
+        echo "test" $test_num "passed"
+    fi
+    rm "$file.even" "$file.odd" "$file.png" "$file.2.bin"
+}
+
 make -C ../example
 mv ../example/converter .
 test_file 1 "nes_2bpp" 2 planar
 test_file 2 "gba_4bpp" 4 gba
+test_pipe 3 "nes_2bpp" 2 planar
+test_file 4 "gba_4bpp" 4 n64
+test_file 5 "nes_2bpp" 2 ngp
+test_container 6 "gba_4bpp" 4 gba
+test_qoi 7 "gba_4bpp" 4 gba
+test_bits 8 "nes_2bpp" 2 planar
+test_zip 9 "gba_4bpp" 4 gba
+test_romset 10 "nes_2bpp" 2 planar
+test_bits_shifted 11 "gba_4bpp" 4 gba 3
 rm converter
+g++ -I../lib -std=c++20 -Wall -Wextra -pthread codec.cpp ../lib/retrogfx.cpp -o codec -lfmt
+./codec 12
+rm codec